@@ -0,0 +1,145 @@
+#!/usr/bin/perl
+#
+# Runs the synthetic kernels of bench/workload under miniprof and checks
+# that the events counted on the core running the kernel match the expected
+# signatures (see bench/signatures for the format).
+#
+# Rows using hardware events (-e) are skipped when the PMU is not available
+# (e.g. in a VM), so that the software events can still be checked.
+#
+use strict;
+use warnings;
+use File::Basename;
+use File::Temp qw(tempfile);
+use Getopt::Long;
+use POSIX qw(:sys_wait_h);
+use Time::HiRes qw(sleep);
+
+my $dir = dirname(__FILE__);
+my $miniprof = "$dir/../miniprof";
+my $workload = "$dir/workload";
+my $seconds = 3;
+my $core;
+
+sub HELP_MESSAGE() {
+   print "Usage:\tcalibrate.pl [-c CORE] [-t SECONDS] [--miniprof PATH] [SIGNATURE_FILES]\n";
+   print "\t-c: core on which the kernels are pinned (default: last core)\n";
+   print "\t-t: duration of each kernel (default: $seconds s)\n";
+   print "\tSIGNATURE_FILES: default $dir/signatures $dir/signatures.generic\n";
+   exit 2;
+}
+
+GetOptions("c=i" => \$core, "t=f" => \$seconds, "miniprof=s" => \$miniprof) or HELP_MESSAGE;
+my @files = @ARGV ? @ARGV : ("$dir/signatures", "$dir/signatures.generic");
+if(!defined $core) {
+   $core = `getconf _NPROCESSORS_ONLN` - 1;
+}
+
+# Parse the signatures. Rows that use the same kernel, arguments and kind
+# of events (software or hardware) are measured during the same run.
+my (@runs, %run_of);
+for my $file (@files) {
+   open(my $fh, '<', $file) or die "Cannot open $file: $!\n";
+   while(my $line = <$fh>) {
+      chomp $line;
+      $line =~ s/#.*//;
+      next if($line =~ /^\s*$/);
+
+      my @fields = map { s/^\s+|\s+$//gr } split(/\|/, $line);
+      die "$file:$.: expected 6 fields separated by '|'\n" if(@fields != 6);
+      my ($kernel, $args, $event, $metric, $min, $max) = @fields;
+      my @event = split(/\s+/, $event);
+      die "$file:$.: unknown event specification $event\n" if(@event < 2 || $event[0] !~ /^-[es]$/);
+      die "$file:$.: unknown metric $metric\n" if($metric !~ /^(per_op|ratio:.+)$/);
+
+      my $hw = ($event[0] eq '-e');
+      my $key = "$kernel|$args|$hw";
+      if(!defined $run_of{$key}) {
+         push(@runs, { kernel => $kernel, args => $args, hw => $hw, events => [], rows => [] });
+         $run_of{$key} = $runs[-1];
+      }
+      my $run = $run_of{$key};
+      (my $name = $event[1]) =~ s/@.*//;
+      push(@{$run->{events}}, @event) if(!grep { $_->{name} eq $name } @{$run->{rows}});
+      push(@{$run->{rows}}, { name => $name, metric => $metric, min => $min, max => $max });
+   }
+   close($fh);
+}
+
+# Starts miniprof, runs the kernel and returns the number of operations of
+# the kernel and the number of events counted on $core, by event name.
+sub measure {
+   my ($run) = @_;
+   my ($tfh, $trace) = tempfile(UNLINK => 1);
+
+   my $pid = fork();
+   die "fork: $!\n" if(!defined $pid);
+   if(!$pid) {
+      open(STDOUT, '>', $trace) or die;
+      open(STDERR, '>&', \*STDOUT) or die;
+      exec($miniprof, @{$run->{events}}) or die "Cannot run $miniprof: $!\n";
+   }
+
+   # Let miniprof open its counters (its output is buffered, so do not
+   # wait for the header)
+   sleep(1);
+
+   my $ops;
+   my @cmd = ($workload, $core, $seconds, $run->{kernel}, split(/\s+/, $run->{args}));
+   open(my $wfh, '-|', @cmd) or die "Cannot run $workload: $!\n";
+   while(<$wfh>) {
+      $ops = $1 if(/^ops\t(\d+)/);
+   }
+   close($wfh);
+
+   sleep(1.5);
+   kill('TERM', $pid);
+   waitpid($pid, 0);
+
+   my (%names, %counts, $error);
+   open(my $fh, '<', $trace) or die;
+   while(<$fh>) {
+      if(/^#Event (\d+): (.*?) \(/) {
+         $names{$1} = $2;
+      } elsif(/sys_perf_counter_open failed.*: (.*)/) {
+         $error = $1;
+      } elsif(/^(\d+)\t(\d+)\t\d+\t(\d+)\t/ && $2 == $core) {
+         $counts{$names{$1}} += $3;
+      }
+   }
+   close($fh);
+
+   return ($ops, \%counts, $error);
+}
+
+my ($nb_pass, $nb_fail, $nb_skip) = (0, 0, 0);
+for my $run (@runs) {
+   my ($ops, $counts, $error) = measure($run);
+   my $desc = "$run->{kernel} $run->{args}";
+
+   for my $row (@{$run->{rows}}) {
+      my ($status, $value);
+      if(defined $error) {
+         $status = $run->{hw} ? "SKIP ($error)" : "FAIL ($error)";
+      } elsif(!$ops) {
+         $status = "FAIL (kernel did not run)";
+      } else {
+         my $count = $counts->{$row->{name}} // 0;
+         if($row->{metric} eq 'per_op') {
+            $value = $count / $ops;
+         } else {
+            (my $other = $row->{metric}) =~ s/^ratio://;
+            my $base = $counts->{$other};
+            $value = $base ? $count / $base : 0;
+         }
+         $status = ($value >= $row->{min} && $value <= $row->{max}) ? "PASS" : "FAIL";
+      }
+
+      printf("%-22s %-20s %-26s %12s  [%g, %g]  %s\n", $desc, $row->{name}, $row->{metric},
+         defined $value ? sprintf("%.4g", $value) : "-", $row->{min}, $row->{max}, $status);
+      if($status =~ /^PASS/) { $nb_pass++; } elsif($status =~ /^SKIP/) { $nb_skip++; } else { $nb_fail++; }
+   }
+}
+
+print "#$nb_pass passed, $nb_fail failed, $nb_skip skipped (core $core)\n";
+exit($nb_fail ? 1 : 0);
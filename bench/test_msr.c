@@ -0,0 +1,166 @@
+/*
+Copyright (C) 2012
+Fabien Gaud <fgaud@sfu.ca>, Baptiste Lepers <baptiste.lepers@inria.fr>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Unit tests of the MSR counter constraints and scheduling of --use-msr
+ * (machine.c), with a faked processor family. Run by make test.
+ *
+ * Feasible sets must get a valid assignment (each event on a counter that
+ * can monitor it, no two events of a same cpu on the same counter).
+ * assign_msrs exits when there is no assignment, so infeasible sets are
+ * scheduled in a child process, which must fail.
+ */
+#include "../miniprof.h"
+#include <sys/wait.h>
+
+#define FAM10H    0x100f00
+#define FAM15H    0x600f00
+#define ALL       -1
+
+int ncpus = 4;
+
+static int failures;
+
+/* Counter id of a PERF_CTL address, see get_available_msr */
+static int msr_id(unsigned int family, uint64_t select) {
+   if(family == FAM10H)
+      return select - 0xC0010000;
+   if(select >= 0xC0010240)
+      return 6 + (select - 0xC0010240) / 2;
+   return (select - 0xC0010200) / 2;
+}
+
+static void add(event_t *events, int *nb, const char *name, uint64_t config, int cpu) {
+   event_t *evt = &events[(*nb)++];
+
+   memset(evt, 0, sizeof(*evt));
+   evt->name = name;
+   evt->type = PERF_TYPE_RAW;
+   evt->raw_code = 1;
+   evt->config = config;
+   evt->cpu_filter = cpu;
+}
+
+static int conflict(event_t *a, event_t *b) {
+   return a->cpu_filter == ALL || b->cpu_filter == ALL || a->cpu_filter == b->cpu_filter;
+}
+
+static void check(const char *test, int ok) {
+   printf("%s\t%s\n", ok ? "ok" : "FAIL", test);
+   if(!ok)
+      failures++;
+}
+
+static void feasible(const char *test, unsigned int family, event_t *events, int nb) {
+   int i, j, ok = 1;
+
+   force_processor_family(family);
+   assign_msrs(events, nb);
+
+   for(i = 0; i < nb; i++) {
+      struct msr msr = { .id = msr_id(family, events[i].msr_select), .select = events[i].msr_select };
+      int (*can_be_used)(struct msr *, uint64_t) = (family == FAM10H) ? can_be_used_10h : can_be_used_15h;
+
+      if(events[i].msr_value != events[i].msr_select + (family == FAM10H ? 4 : 1) || !can_be_used(&msr, events[i].config))
+         ok = 0;
+      for(j = 0; j < i; j++) {
+         if(events[i].msr_select == events[j].msr_select && conflict(&events[i], &events[j]))
+            ok = 0;
+      }
+   }
+   check(test, ok);
+}
+
+static void infeasible(const char *test, unsigned int family, event_t *events, int nb) {
+   int status;
+   pid_t pid;
+
+   fflush(stdout);
+   pid = fork();
+
+   if(pid == 0) {
+      if(!freopen("/dev/null", "w", stderr)) {};
+      force_processor_family(family);
+      assign_msrs(events, nb);
+      exit(0);
+   }
+   waitpid(pid, &status, 0);
+   check(test, WIFEXITED(status) && WEXITSTATUS(status) != 0);
+}
+
+static void test_constraints(void) {
+   struct msr core3 = { .id = 3, .select = 0xC0010206 };
+   struct msr core0 = { .id = 0, .select = 0xC0010200 };
+   struct msr nb6 = { .id = 6, .select = 0xC0010240 };
+
+   check("10h: any event on any counter", can_be_used_10h(&core0, 0x76) && can_be_used_10h(&core0, 0xE0));
+   check("15h: FP 00h only on counter 3", can_be_used_15h(&core3, 0x00) && !can_be_used_15h(&core0, 0x00));
+   check("15h: CU 76h only on counters 0-2", can_be_used_15h(&core0, 0x76) && !can_be_used_15h(&core3, 0x76));
+   check("15h: NB E0h only on NB counters", can_be_used_15h(&nb6, 0x1E0) && !can_be_used_15h(&core0, 0x1E0));
+   check("15h: core events not on NB counters", !can_be_used_15h(&nb6, 0x76));
+}
+
+int main(void) {
+   event_t events[16];
+   int nb;
+
+   test_constraints();
+
+   nb = 0;
+   add(events, &nb, "A", 0x76, ALL); add(events, &nb, "B", 0x76, ALL);
+   add(events, &nb, "C", 0x76, ALL); add(events, &nb, "D", 0x76, ALL);
+   feasible("10h: 4 events on 4 counters", FAM10H, events, nb);
+   add(events, &nb, "E", 0x76, ALL);
+   infeasible("10h: 5 events on all cpus", FAM10H, events, nb);
+
+   /* Events pinned on different cpus share a counter */
+   nb = 0;
+   add(events, &nb, "A", 0x76, 0); add(events, &nb, "B", 0x76, 1);
+   add(events, &nb, "C", 0x76, ALL); add(events, &nb, "D", 0x76, ALL);
+   add(events, &nb, "E", 0x76, ALL);
+   feasible("10h: A on cpu 0, B on cpu 1, C-E on all cpus", FAM10H, events, nb);
+
+   nb = 0;
+   add(events, &nb, "C", 0x76, ALL); add(events, &nb, "D", 0x76, ALL);
+   add(events, &nb, "E", 0x76, ALL); add(events, &nb, "A", 0x76, 0);
+   add(events, &nb, "B", 0x76, 1);
+   feasible("10h: same events, reverse order", FAM10H, events, nb);
+
+   /* DC events can use counters 0-5, but FP events need 3-5 */
+   nb = 0;
+   add(events, &nb, "DC1", 0x41, ALL); add(events, &nb, "DC2", 0x41, ALL);
+   add(events, &nb, "DC3", 0x41, ALL); add(events, &nb, "FP1", 0x01, ALL);
+   add(events, &nb, "FP2", 0x02, ALL); add(events, &nb, "FP3", 0x00, ALL);
+   feasible("15h: DC events moved to counters 0-2 for FP events", FAM15H, events, nb);
+
+   nb = 0;
+   add(events, &nb, "FP1", 0x00, ALL); add(events, &nb, "FP2", 0x03, ALL);
+   infeasible("15h: two events that only fit on counter 3", FAM15H, events, nb);
+
+   nb = 0;
+   add(events, &nb, "NB1", 0x1E0, ALL); add(events, &nb, "NB2", 0x2E0, ALL);
+   add(events, &nb, "NB3", 0x4E0, ALL); add(events, &nb, "NB4", 0x8E0, ALL);
+   add(events, &nb, "CU1", 0x76, ALL); add(events, &nb, "CU2", 0x76, ALL);
+   add(events, &nb, "CU3", 0x76, ALL); add(events, &nb, "FP1", 0x01, ALL);
+   add(events, &nb, "FP2", 0x01, ALL); add(events, &nb, "FP3", 0x01, ALL);
+   feasible("15h: 10 events on 10 counters", FAM15H, events, nb);
+   add(events, &nb, "DC1", 0x41, ALL);
+   infeasible("15h: 11 events on 10 counters", FAM15H, events, nb);
+
+   printf("%s\n", failures ? "FAILED" : "PASSED");
+   return failures ? 1 : 0;
+}
@@ -0,0 +1,146 @@
+#!/usr/bin/perl
+#
+# Checks the MSR source of --power against fake MSR files (--msr-path):
+# regular files holding each register as 8 little-endian bytes at offset
+# 8 x MSR number (see msr_offset in machine.c).
+#
+# The registers are advanced twice, more than one period apart so that
+# each update lands in its own interval. The second update wraps the 32-bit
+# package energy counter (0xfffffff0 -> 0x10). The test checks the #Energy
+# and #Frequency lines of the intervals containing the updates, and on
+# Intel the unit of the DRAM domain, which is fixed on server parts.
+#
+use strict;
+use warnings;
+use File::Basename;
+use File::Temp qw(tempdir);
+use Getopt::Long;
+use Fcntl;
+use Time::HiRes qw(sleep);
+no warnings 'portable';    # 64-bit register values
+
+my $dir = dirname(__FILE__);
+my $miniprof = "$dir/../miniprof";
+my $period_ms = 300;
+
+GetOptions("miniprof=s" => \$miniprof) or die "Usage: test_power.pl [--miniprof PATH]\n";
+
+# Intel and AMD registers are both written, so that the test runs on both
+my %msr = (
+   mperf => 0xE7, aperf => 0xE8,
+   intel_unit => 0x606, intel_pkg => 0x611, intel_pp0 => 0x639, intel_dram => 0x619,
+   amd_unit => 0xC0010299, amd_core => 0xC001029A, amd_pkg => 0xC001029B,
+);
+my $esu = 14;                                  # 1/2^14 J = 61 uJ
+my $joules = 1 / (1 << $esu);
+
+# Intel server models with a fixed DRAM energy unit of 2^-16 J (see
+# has_fixed_dram_unit in telemetry.c)
+my %fixed_dram_unit = map { $_ => 1 } (0x3F, 0x4F, 0x56, 0x55, 0x57, 0x85, 0x6A, 0x6C, 0x8F, 0xCF, 0xAD);
+my $cpuinfo = `cat /proc/cpuinfo`;
+my $is_intel = $cpuinfo =~ /^vendor_id\s*:\s*GenuineIntel/m;
+my ($family) = $cpuinfo =~ /^cpu family\s*:\s*(\d+)/m;
+my ($model) = $cpuinfo =~ /^model\s*:\s*(\d+)/m;
+my $dram_joules = ($family == 6 && $fixed_dram_unit{$model}) ? 1 / (1 << 16) : $joules;
+
+my $tmp = tempdir("miniprof-msr-XXXXXX", TMPDIR => 1, CLEANUP => 1);
+my $ncpus = `getconf _NPROCESSORS_ONLN`;
+chomp $ncpus;
+
+sub write_msrs {
+   my (%values) = @_;
+   for my $cpu (0 .. $ncpus - 1) {
+      sysopen(my $fh, "$tmp/$cpu", O_RDWR | O_CREAT) or die "Cannot open $tmp/$cpu: $!\n";
+      for my $reg (sort { $msr{$a} <=> $msr{$b} } keys %values) {
+         sysseek($fh, 8 * $msr{$reg}, 0) or die "seek: $!\n";
+         syswrite($fh, pack("Q<", $values{$reg})) == 8 or die "write: $!\n";
+      }
+      close($fh);
+   }
+}
+
+# Energy status registers: the upper 32 bits are reserved, and must be ignored
+my @pkg = (0xdead0000ffffff00, 0xbeef0000fffffff0, 0x0123000000000010);
+my @dram = (0, 0x10000, 0x20000);
+my $dmperf = 100_000_000;
+my @mperf = map { (1 << 40) + $_ * $dmperf } 0 .. 2;
+my @aperf = map { $_ * 3 / 2 } @mperf;         # 1.5 x the TSC frequency
+
+sub state {
+   my ($step) = @_;
+   return (intel_unit => 0xA0003 | ($esu << 8), amd_unit => 0xA0003 | ($esu << 8),
+      intel_pkg => $pkg[$step], amd_pkg => $pkg[$step],
+      intel_pp0 => 0, intel_dram => $dram[$step], amd_core => 0,
+      mperf => $mperf[$step], aperf => $aperf[$step]);
+}
+
+write_msrs(state(0));
+my $out = "$tmp/trace";
+my $pid = fork();
+if(!$pid) {
+   open(STDOUT, '>', $out) or die;
+   open(STDERR, '>', "$tmp/err") or die;
+   exec($miniprof, "--power", "msr", "--msr-path", "$tmp/%d", "-p", $period_ms) or die;
+}
+
+# Let miniprof start and take the baselines, then update the registers
+# twice, 3 periods apart
+sleep(1.5);
+write_msrs(state(1));
+sleep(3 * $period_ms / 1000);
+write_msrs(state(2));
+sleep(3 * $period_ms / 1000);
+kill('INT', $pid);
+waitpid($pid, 0);
+
+my ($clock, $source, @energy, @dram_energy, @freq, $summary);
+open(my $fh, '<', $out) or die;
+while(my $line = <$fh>) {
+   chomp $line;
+   $clock = $1 if($line =~ /^#Clock speed: (\d+)/);
+   $source = $line if($line =~ /^#Telemetry:/);
+   push(@energy, $1) if($line =~ /^#Energy\t\d+\tpkg\t0\t([\d.]+)\t/);
+   push(@dram_energy, $1) if($line =~ /^#Energy\t\d+\tdram\t0\t([\d.]+)\t/);
+   push(@freq, [$1, $2]) if($line =~ /^#Frequency\t\d+\t0\t([\d.]+)\t([\d.]+)/);
+   $summary = $1 if($line =~ /^#Energy summary\tpkg\t0\t([\d.]+)/);
+}
+close($fh);
+
+my $failures = 0;
+sub check {
+   my ($test, $ok) = @_;
+   print(($ok ? "ok" : "FAIL") . "\t$test\n");
+   $failures++ if(!$ok);
+}
+
+if(!defined $source) {
+   system("cat $tmp/err");
+   die "miniprof did not start\n";
+}
+check("sources: $source", $source =~ /frequency from MSRs.*energy from RAPL MSRs/);
+
+my @nonzero = grep { $_ > 0 } @energy;
+check(sprintf("pkg energy before the wrap: %s J (expected %.6f)", $nonzero[0] // "none", 0xf0 * $joules),
+   @nonzero == 2 && abs($nonzero[0] - 0xf0 * $joules) < 1e-6);
+check(sprintf("pkg energy across the wrap: %s J (expected %.6f)", $nonzero[1] // "none", 0x20 * $joules),
+   @nonzero == 2 && abs($nonzero[1] - 0x20 * $joules) < 1e-6);
+check(sprintf("pkg energy summary: %s J (expected %.3f)", $summary // "none", 0x110 * $joules),
+   defined $summary && abs($summary - 0x110 * $joules) < 1e-3);
+
+if($is_intel) {
+   my @dram_nonzero = grep { $_ > 0 } @dram_energy;
+   my $expected = 0x10000 * $dram_joules;
+   check(sprintf("dram energy of the updated intervals: %s J (expected %.6f)", join(", ", @dram_nonzero), $expected),
+      @dram_nonzero == 2 && !grep { abs($_ - $expected) > 1e-6 } @dram_nonzero);
+}
+
+my @running = grep { $_->[0] > 0 } @freq;
+my $ghz = 1.5 * $clock / 1e9;
+check(sprintf("frequency of the updated intervals: %s GHz (expected %.3f)", join(", ", map { $_->[0] } @running), $ghz),
+   @running == 2 && !grep { abs($_->[0] - $ghz) > 0.002 } @running);
+my $c0 = $dmperf / ($clock * $period_ms / 1000);
+check(sprintf("C0 of the updated intervals: %s (expected %.3f)", join(", ", map { $_->[1] } @running), $c0),
+   @running == 2 && !grep { abs($_->[1] - $c0) > 0.2 * $c0 } @running);
+
+print($failures ? "FAILED\n" : "PASSED\n");
+exit($failures ? 1 : 0);
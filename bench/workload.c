@@ -0,0 +1,264 @@
+/*
+Copyright (C) 2012
+Fabien Gaud <fgaud@sfu.ca>, Baptiste Lepers <baptiste.lepers@inria.fr>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Synthetic kernels used to calibrate events (see bench/calibrate.pl).
+ *
+ * Each kernel pins itself on a core, runs for a given number of seconds
+ * and prints the number of "operations" it performed, so that the number
+ * of events counted by miniprof on that core can be checked against an
+ * expected number of events per operation.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#define PAGE_SIZE               (4*1024)
+#define CACHE_LINE_SIZE         64
+
+#define die(msg, args...) \
+do {                         \
+            fprintf(stderr,"(%s,%d) " msg "\n", __FUNCTION__ , __LINE__, ##args); \
+            exit(-1);                 \
+         } while(0)
+
+struct node {
+   struct node *next;
+   char pad[CACHE_LINE_SIZE - sizeof(struct node *)];
+};
+
+static int core;
+static uint64_t duration_ns;
+
+static uint64_t now_ns(void) {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void pin(void) {
+   cpu_set_t mask;
+   CPU_ZERO(&mask);
+   CPU_SET(core, &mask);
+   if (sched_setaffinity(0, sizeof(mask), &mask))
+      die("Cannot pin the workload on core %d", core);
+}
+
+static uint64_t xorshift(uint64_t *state) {
+   *state ^= *state << 13;
+   *state ^= *state >> 7;
+   *state ^= *state << 17;
+   return *state;
+}
+
+static void *alloc_touched(size_t size) {
+   char *buf = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+   if (buf == MAP_FAILED)
+      die("Cannot allocate %zu bytes", size);
+   memset(buf, 1, size);
+   return buf;
+}
+
+/*
+ * Latency bound: follows a random cyclic permutation of cache lines.
+ * One operation = one dependent load.
+ */
+static uint64_t pointer_chase(size_t size_kb) {
+   size_t i, nb_nodes = size_kb * 1024 / sizeof(struct node);
+   struct node *nodes = alloc_touched(nb_nodes * sizeof(struct node));
+   size_t *perm = malloc(nb_nodes * sizeof(*perm));
+   uint64_t seed = 42, ops = 0, deadline;
+   struct node *n;
+
+   /* Sattolo's algorithm: a single cycle going through all the nodes */
+   for (i = 0; i < nb_nodes; i++)
+      perm[i] = i;
+   for (i = nb_nodes - 1; i > 0; i--) {
+      size_t j = xorshift(&seed) % i, tmp = perm[i];
+      perm[i] = perm[j];
+      perm[j] = tmp;
+   }
+   for (i = 0; i < nb_nodes; i++)
+      nodes[perm[i]].next = &nodes[perm[(i + 1) % nb_nodes]];
+   free(perm);
+
+   n = &nodes[0];
+   deadline = now_ns() + duration_ns;
+   while (now_ns() < deadline) {
+      for (i = 0; i < 64 * 1024; i++)
+         n = n->next;
+      ops += i;
+   }
+   __asm__ __volatile__("" : : "r"(n));
+   return ops;
+}
+
+/*
+ * Bandwidth bound: copies a buffer into another one.
+ * One operation = one cache line read and one cache line written.
+ */
+static uint64_t stream(size_t size_kb) {
+   size_t size = size_kb * 1024 / 2;
+   uint64_t *src = alloc_touched(size), *dst = alloc_touched(size);
+   uint64_t ops = 0, deadline = now_ns() + duration_ns;
+   size_t i;
+
+   while (now_ns() < deadline) {
+      for (i = 0; i < size / sizeof(*src); i++)
+         dst[i] = src[i] + 1;
+      ops += size / CACHE_LINE_SIZE;
+   }
+   __asm__ __volatile__("" : : "r"(dst) : "memory");
+   return ops;
+}
+
+/*
+ * Branch mispredictions: one branch per operation, taken with a 50%
+ * probability on random data. About half of them are mispredicted.
+ */
+static uint64_t branch(void) {
+   size_t i, nb = 1024 * 1024;
+   unsigned char *data = malloc(nb);
+   uint64_t seed = 42, ops = 0, sum = 0, deadline;
+
+   for (i = 0; i < nb; i++)
+      data[i] = xorshift(&seed) & 1;
+
+   deadline = now_ns() + duration_ns;
+   while (now_ns() < deadline) {
+      for (i = 0; i < nb; i++) {
+         if (data[i])
+            sum += i;
+         else
+            __asm__ __volatile__("" : "+r"(sum));
+      }
+      ops += nb;
+   }
+   __asm__ __volatile__("" : : "r"(sum));
+   return ops;
+}
+
+/*
+ * Page fault storm: maps, touches and unmaps anonymous memory.
+ * One operation = one page touched for the first time (one minor fault).
+ */
+static uint64_t page_faults(size_t size_kb) {
+   size_t i, size = size_kb * 1024;
+   uint64_t ops = 0, deadline = now_ns() + duration_ns;
+
+   while (now_ns() < deadline) {
+      char *buf = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (buf == MAP_FAILED)
+         die("Cannot allocate %zu bytes", size);
+      /* Prevent the kernel from using huge pages (one fault per 2MB) */
+      madvise(buf, size, MADV_NOHUGEPAGE);
+      for (i = 0; i < size; i += PAGE_SIZE)
+         buf[i] = 1;
+      munmap(buf, size);
+      ops += size / PAGE_SIZE;
+   }
+   return ops;
+}
+
+/*
+ * Context switch ping-pong between two threads pinned on the same core.
+ * One operation = one round trip = two context switches.
+ */
+static int ping[2], pong[2];
+
+static void *ponger(void *arg) {
+   char c;
+
+   pin();
+   while (read(ping[0], &c, 1) == 1 && c)
+      if (write(pong[1], &c, 1) != 1)
+         break;
+   return NULL;
+}
+
+static uint64_t ctx_switch(void) {
+   pthread_t thread;
+   uint64_t ops = 0, deadline;
+   char c = 1;
+
+   if (pipe(ping) || pipe(pong))
+      die("Cannot create pipes");
+   pthread_create(&thread, NULL, ponger, NULL);
+
+   deadline = now_ns() + duration_ns;
+   while (now_ns() < deadline) {
+      if (write(ping[1], &c, 1) != 1 || read(pong[0], &c, 1) != 1)
+         die("Ping-pong failed");
+      ops++;
+   }
+
+   c = 0;
+   if (write(ping[1], &c, 1) != 1)
+      die("Ping-pong failed");
+   pthread_join(thread, NULL);
+   return ops;
+}
+
+static void usage(char *name) {
+   printf("Usage: %s CORE SECONDS KERNEL [ARGS]\n", name);
+   printf("Kernels:\n");
+   printf("\tpointer-chase SIZE_KB\n");
+   printf("\tstream SIZE_KB\n");
+   printf("\tbranch\n");
+   printf("\tpage-faults SIZE_KB\n");
+   printf("\tctx-switch\n");
+   exit(1);
+}
+
+int main(int argc, char **argv) {
+   uint64_t ops, start;
+   char *kernel;
+   size_t size_kb;
+
+   if (argc < 4)
+      usage(argv[0]);
+   core = atoi(argv[1]);
+   duration_ns = (uint64_t) (atof(argv[2]) * 1e9);
+   kernel = argv[3];
+   size_kb = (argc > 4) ? strtoull(argv[4], NULL, 0) : 0;
+
+   pin();
+   start = now_ns();
+   if (!strcmp(kernel, "pointer-chase") && size_kb)
+      ops = pointer_chase(size_kb);
+   else if (!strcmp(kernel, "stream") && size_kb)
+      ops = stream(size_kb);
+   else if (!strcmp(kernel, "branch"))
+      ops = branch();
+   else if (!strcmp(kernel, "page-faults") && size_kb)
+      ops = page_faults(size_kb);
+   else if (!strcmp(kernel, "ctx-switch"))
+      ops = ctx_switch();
+   else
+      usage(argv[0]);
+
+   printf("ops\t%llu\n", (long long unsigned) ops);
+   printf("elapsed_ns\t%llu\n", (long long unsigned) (now_ns() - start));
+   return 0;
+}
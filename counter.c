@@ -0,0 +1,167 @@
+/*
+Copyright (C) 2012
+Fabien Gaud <fgaud@sfu.ca>, Baptiste Lepers <baptiste.lepers@inria.fr>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "miniprof.h"
+
+/*
+ * Perf counters, shared by miniprof and libminiprof.
+ *
+ * With COUNTER_MMAP, the perf mmap page of the counter is mapped and reads
+ * use rdpmc when the kernel allows it (cap_user_rdpmc) and the counter is
+ * currently scheduled on a hardware counter, without any system call. This
+ * is only valid when the caller runs where the counter counts: counters of
+ * the calling thread, or per-cpu counters read from a thread pinned on that
+ * cpu. Otherwise (software events, multiplexed-out counters, no mmap) the
+ * counter is read with read().
+ */
+#define barrier() __asm__ __volatile__("" : : : "memory")
+
+long mp_sys_perf_counter_open(struct perf_event_attr *hw_event, pid_t pid, int cpu, int group_fd, unsigned long flags) {
+   int ret = syscall(__NR_perf_counter_open, hw_event, pid, cpu, group_fd, flags);
+#if defined(__x86_64__) || defined(__i386__)
+   if (ret < 0 && ret > -4096) {
+      errno = -ret;
+      ret = -1;
+   }
+#endif
+   return ret;
+}
+
+/*
+ * Opens a perf counter for the given event, either on a core (tid = -1)
+ * or on a tid (core = -1). Returns the fd, or -1 with errno set.
+ */
+int mp_counter_open(struct counter *c, event_t *evt, int tid, int core, int group_fd, int flags) {
+   struct perf_event_attr attr;
+
+   memset(&attr, 0, sizeof(attr));
+   attr.size = sizeof(struct perf_event_attr);
+   attr.type = evt->type;
+   attr.config = evt->config;
+   attr.config1 = evt->config1;
+   attr.config2 = evt->config2;
+   attr.exclude_kernel = evt->exclude_kernel;
+   attr.exclude_user = evt->exclude_user;
+   attr.disabled = !!(flags & COUNTER_DISABLED);
+   attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+   if (flags & COUNTER_GROUP_READ)
+      attr.read_format |= PERF_FORMAT_GROUP;
+
+   c->page = NULL;
+   c->fd = mp_sys_perf_counter_open(&attr, tid, core, group_fd, 0);
+   if (c->fd < 0)
+      return -1;
+
+   if (flags & COUNTER_MMAP) {
+      void *page = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, c->fd, 0);
+      if (page != MAP_FAILED)
+         c->page = page;
+   }
+   return c->fd;
+}
+
+static inline uint64_t rdpmc(uint32_t counter) {
+   uint32_t low, high;
+   __asm__ __volatile__("rdpmc" : "=a" (low), "=d" (high) : "c" (counter));
+   return low | ((uint64_t) high) << 32;
+}
+
+/*
+ * Reads the counter from the mmap page, see the description of
+ * struct perf_event_mmap_page in linux/perf_event.h. Returns 0 when the
+ * counter must be read with read().
+ */
+static int counter_read_mmap(struct perf_event_mmap_page *pc, struct perf_read_ev *v) {
+   uint64_t count, enabled, running;
+   uint32_t seq, idx;
+
+   do {
+      seq = pc->lock;
+      barrier();
+
+      idx = pc->index;
+      if (!pc->cap_user_rdpmc || !idx)
+         return 0;
+
+      enabled = pc->time_enabled;
+      running = pc->time_running;
+      count = pc->offset;
+
+      int64_t pmc = rdpmc(idx - 1);
+      pmc <<= 64 - pc->pmc_width;
+      pmc >>= 64 - pc->pmc_width;
+      count += pmc;
+
+      if (pc->cap_user_time) {
+         uint64_t cyc, quot, rem, delta;
+
+         rdtscll(cyc);
+         quot = cyc >> pc->time_shift;
+         rem = cyc & (((uint64_t) 1 << pc->time_shift) - 1);
+         delta = pc->time_offset + quot * pc->time_mult + ((rem * pc->time_mult) >> pc->time_shift);
+         enabled += delta;
+         running += delta;
+      }
+
+      barrier();
+   } while (pc->lock != seq);
+
+   v->value = count;
+   v->time_enabled = enabled;
+   v->time_running = running;
+   return 1;
+}
+
+/* Returns 0, or -1 with errno set */
+int mp_counter_read(struct counter *c, struct perf_read_ev *v) {
+   if (c->page && counter_read_mmap(c->page, v))
+      return 0;
+   return (read(c->fd, v, sizeof(*v)) == sizeof(*v)) ? 0 : -1;
+}
+
+/*
+ * Reads the nb_counters counters of a group opened with COUNTER_GROUP_READ
+ * with a single read() on the leader. The counters of a group are scheduled
+ * together, so they share time_enabled and time_running.
+ * Returns 0, or -1 with errno set.
+ */
+int mp_counter_read_group(int leader_fd, int nb_counters, struct perf_read_ev *v) {
+   uint64_t buf[3 + nb_counters]; /* nr, time_enabled, time_running, values */
+   int i;
+
+   if (read(leader_fd, buf, sizeof(buf)) != sizeof(buf))
+      return -1;
+   if (buf[0] != (uint64_t) nb_counters) {
+      errno = EINVAL;
+      return -1;
+   }
+   for (i = 0; i < nb_counters; i++) {
+      v[i].value = buf[3 + i];
+      v[i].time_enabled = buf[1];
+      v[i].time_running = buf[2];
+   }
+   return 0;
+}
+
+void mp_counter_close(struct counter *c) {
+   if (c->page)
+      munmap(c->page, sysconf(_SC_PAGESIZE));
+   if (c->fd >= 0)
+      close(c->fd);
+   c->page = NULL;
+   c->fd = -1;
+}
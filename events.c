@@ -0,0 +1,458 @@
+/*
+Copyright (C) 2012
+Fabien Gaud <fgaud@sfu.ca>, Baptiste Lepers <baptiste.lepers@inria.fr>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "miniprof.h"
+#include <ctype.h>
+
+/*
+ * Resolution of symbolic event names (see README, "Symbolic events"),
+ * shared by miniprof and libminiprof:
+ *  - generic software and hardware events (page-faults, cycles, ...)
+ *  - generic cache events: CACHE[.OP[.RESULT]] (L1D.read.miss, LLC, ...)
+ *  - tracepoints: SUBSYSTEM:EVENT (sched:sched_switch)
+ *  - sysfs PMU events: PMU/ALIAS/ or PMU/TERM=VALUE,.../, and ALIAS alone
+ *    when a PMU exports it
+ */
+#define SYSFS_PMUS "/sys/bus/event_source/devices"
+
+/* Part of libminiprof: report errors to the caller instead of exiting */
+#define event_error(msg, args...) \
+do {                         \
+            fprintf(stderr,"(%s,%d) " msg "\n", __FUNCTION__ , __LINE__, ##args); \
+            return -1;                \
+         } while(0)
+
+struct event_symbol {
+   const char *symbol;
+   const char *alias;
+};
+
+// This code is directly imported from <linux_src>/tools/perf/util/parse-events.c
+static struct event_symbol event_symbols_sw[PERF_COUNT_SW_MAX] = {
+   [PERF_COUNT_SW_CPU_CLOCK] = {
+      .symbol = "cpu-clock",
+   },
+   [PERF_COUNT_SW_TASK_CLOCK] = {
+      .symbol = "task-clock",
+   },
+   [PERF_COUNT_SW_PAGE_FAULTS] = {
+      .symbol = "page-faults",
+      .alias = "faults",
+   },
+   [PERF_COUNT_SW_CONTEXT_SWITCHES] = {
+      .symbol = "context-switches",
+      .alias = "cs",
+   },
+   [PERF_COUNT_SW_CPU_MIGRATIONS] = {
+      .symbol = "cpu-migrations",
+      .alias = "migrations",
+   },
+   [PERF_COUNT_SW_PAGE_FAULTS_MIN] = {
+      .symbol = "minor-faults",
+   },
+   [PERF_COUNT_SW_PAGE_FAULTS_MAJ] = {
+      .symbol = "major-faults",
+   },
+#ifdef PERF_COUNT_SW_ALIGNMENT_FAULTS
+   [PERF_COUNT_SW_ALIGNMENT_FAULTS] = {
+      .symbol = "alignment-faults",
+   },
+#endif
+#ifdef PERF_COUNT_SW_EMULATION_FAULTS
+   [PERF_COUNT_SW_EMULATION_FAULTS] = {
+      .symbol = "emulation-faults",
+   },
+#endif
+};
+
+static struct event_symbol event_symbols_hw[PERF_COUNT_HW_MAX] = {
+   [PERF_COUNT_HW_CPU_CYCLES] = {
+      .symbol = "cpu-cycles",
+      .alias = "cycles",
+   },
+   [PERF_COUNT_HW_INSTRUCTIONS] = {
+      .symbol = "instructions",
+   },
+   [PERF_COUNT_HW_CACHE_REFERENCES] = {
+      .symbol = "cache-references",
+   },
+   [PERF_COUNT_HW_CACHE_MISSES] = {
+      .symbol = "cache-misses",
+   },
+   [PERF_COUNT_HW_BRANCH_INSTRUCTIONS] = {
+      .symbol = "branch-instructions",
+      .alias = "branches",
+   },
+   [PERF_COUNT_HW_BRANCH_MISSES] = {
+      .symbol = "branch-misses",
+   },
+   [PERF_COUNT_HW_BUS_CYCLES] = {
+      .symbol = "bus-cycles",
+   },
+   [PERF_COUNT_HW_STALLED_CYCLES_FRONTEND] = {
+      .symbol = "stalled-cycles-frontend",
+      .alias = "idle-cycles-frontend",
+   },
+   [PERF_COUNT_HW_STALLED_CYCLES_BACKEND] = {
+      .symbol = "stalled-cycles-backend",
+      .alias = "idle-cycles-backend",
+   },
+   [PERF_COUNT_HW_REF_CPU_CYCLES] = {
+      .symbol = "ref-cycles",
+   },
+};
+
+static const char *hw_cache_names[PERF_COUNT_HW_CACHE_MAX] = {
+   [PERF_COUNT_HW_CACHE_L1D] = "L1D",
+   [PERF_COUNT_HW_CACHE_L1I] = "L1I",
+   [PERF_COUNT_HW_CACHE_LL] = "LLC",
+   [PERF_COUNT_HW_CACHE_DTLB] = "dTLB",
+   [PERF_COUNT_HW_CACHE_ITLB] = "iTLB",
+   [PERF_COUNT_HW_CACHE_BPU] = "branch",
+   [PERF_COUNT_HW_CACHE_NODE] = "node",
+};
+
+static const char *hw_cache_ops[PERF_COUNT_HW_CACHE_OP_MAX] = {
+   [PERF_COUNT_HW_CACHE_OP_READ] = "read",
+   [PERF_COUNT_HW_CACHE_OP_WRITE] = "write",
+   [PERF_COUNT_HW_CACHE_OP_PREFETCH] = "prefetch",
+};
+
+static const char *hw_cache_results[PERF_COUNT_HW_CACHE_RESULT_MAX] = {
+   [PERF_COUNT_HW_CACHE_RESULT_ACCESS] = "access",
+   [PERF_COUNT_HW_CACHE_RESULT_MISS] = "miss",
+};
+
+static const char *tracefs_dirs[] = {
+   "/sys/kernel/tracing",
+   "/sys/kernel/debug/tracing",
+};
+
+static int find_symbol(struct event_symbol *symbols, int nb_symbols, const char *name) {
+   int i;
+
+   for (i = 0; i < nb_symbols; i++) {
+      if (symbols[i].symbol && !strcmp(symbols[i].symbol, name))
+         return i;
+      if (symbols[i].alias && !strcmp(symbols[i].alias, name))
+         return i;
+   }
+   return -1;
+}
+
+static int find_name(const char **names, int nb_names, const char *name, size_t len) {
+   int i;
+
+   for (i = 0; i < nb_names; i++) {
+      if (names[i] && strlen(names[i]) == len && !strncasecmp(names[i], name, len))
+         return i;
+   }
+   return -1;
+}
+
+/* Reads the first line of a file, without the trailing newline */
+static int read_line(const char *path, char *buf, size_t size) {
+   FILE *f = fopen(path, "r");
+
+   if (!f)
+      return 0;
+   if (!fgets(buf, size, f))
+      buf[0] = '\0';
+   buf[strcspn(buf, "\n")] = '\0';
+   fclose(f);
+   return 1;
+}
+
+/* CACHE[.OP[.RESULT]], op defaults to read and result to access */
+static int parse_hw_cache(const char *name, event_t *evt) {
+   const char *op = strchr(name, '.'), *result = NULL;
+   int cache, op_id = PERF_COUNT_HW_CACHE_OP_READ, result_id = PERF_COUNT_HW_CACHE_RESULT_ACCESS;
+
+   cache = find_name(hw_cache_names, PERF_COUNT_HW_CACHE_MAX, name, op ? (size_t) (op - name) : strlen(name));
+   if (cache < 0)
+      return 0;
+
+   if (op) {
+      op++;
+      result = strchr(op, '.');
+      op_id = find_name(hw_cache_ops, PERF_COUNT_HW_CACHE_OP_MAX, op, result ? (size_t) (result - op) : strlen(op));
+      if (op_id < 0)
+         event_error("Unknown cache operation in %s (expected read, write or prefetch)", name);
+   }
+   if (result) {
+      result++;
+      result_id = find_name(hw_cache_results, PERF_COUNT_HW_CACHE_RESULT_MAX, result, strlen(result));
+      if (result_id < 0)
+         event_error("Unknown cache result in %s (expected access or miss)", name);
+   }
+
+   evt->type = PERF_TYPE_HW_CACHE;
+   evt->config = cache | (op_id << 8) | (result_id << 16);
+   return 1;
+}
+
+/* SUBSYSTEM:EVENT, the id is read from tracefs */
+static int parse_tracepoint(const char *name, event_t *evt) {
+   const char *colon = strchr(name, ':');
+   char path[1024], id[32];
+   size_t i;
+
+   if (!colon || strchr(name, '/'))
+      return 0;
+
+   for (i = 0; i < sizeof(tracefs_dirs) / sizeof(*tracefs_dirs); i++) {
+      snprintf(path, sizeof(path), "%s/events/%.*s/%s/id", tracefs_dirs[i], (int) (colon - name), name, colon + 1);
+      if (read_line(path, id, sizeof(id))) {
+         evt->type = PERF_TYPE_TRACEPOINT;
+         evt->config = strtoull(id, NULL, 0);
+         return 1;
+      }
+   }
+   event_error("Cannot find tracepoint %s (is tracefs mounted on /sys/kernel/tracing?)", name);
+}
+
+/*
+ * Sets the bits of "value" in the config field described by the sysfs
+ * format of the term, e.g. "config:0-7,32-35" or "config1:0-15".
+ */
+static int apply_format(const char *pmu, const char *term, uint64_t value, event_t *evt) {
+   char path[1024], format[128], *ranges, *range, *saveptr;
+   uint64_t *config;
+
+   snprintf(path, sizeof(path), SYSFS_PMUS "/%s/format/%s", pmu, term);
+   if (!read_line(path, format, sizeof(format)))
+      event_error("PMU %s has no term %s", pmu, term);
+
+   ranges = strchr(format, ':');
+   if (!ranges)
+      event_error("Cannot parse the format of %s/%s: %s", pmu, term, format);
+   *ranges++ = '\0';
+
+   if (!strcmp(format, "config"))
+      config = &evt->config;
+   else if (!strcmp(format, "config1"))
+      config = &evt->config1;
+   else if (!strcmp(format, "config2"))
+      config = &evt->config2;
+   else
+      event_error("Unsupported format for %s/%s: %s", pmu, term, format);
+
+   for (range = strtok_r(ranges, ",", &saveptr); range; range = strtok_r(NULL, ",", &saveptr)) {
+      int lo, hi;
+
+      if (sscanf(range, "%d-%d", &lo, &hi) != 2)
+         hi = lo = atoi(range);
+      if (lo < 0 || hi >= 64 || lo > hi)
+         event_error("Invalid bit range %s in the format of %s/%s", range, pmu, term);
+
+      /* A 64-bit wide range (config:0-63) consumes the whole value */
+      if (hi - lo == 63) {
+         *config |= value;
+         value = 0;
+         continue;
+      }
+      *config |= (value & ((1ULL << (hi - lo + 1)) - 1)) << lo;
+      value >>= hi - lo + 1;
+   }
+   return 0;
+}
+
+/* TERM[=VALUE],... as found in the events/ directory of a PMU */
+static int apply_terms(const char *pmu, const char *terms, event_t *evt) {
+   char *copy = strdup(terms), *term, *saveptr;
+   int ret = 0;
+
+   for (term = strtok_r(copy, ",", &saveptr); term && !ret; term = strtok_r(NULL, ",", &saveptr)) {
+      char *eq = strchr(term, '=');
+      uint64_t value = 1;
+
+      while (isspace(*term))
+         term++;
+      if (eq) {
+         *eq = '\0';
+         if (eq[1] == '?') {
+            fprintf(stderr, "Event %s/%s/ needs a value for %s\n", pmu, terms, term);
+            ret = -1;
+            break;
+         }
+         value = strtoull(eq + 1, NULL, 0);
+      }
+      ret = apply_format(pmu, term, value, evt);
+   }
+   free(copy);
+   return ret;
+}
+
+static int pmu_has_alias(const char *pmu, const char *alias, char *terms, size_t size) {
+   char path[1024];
+
+   snprintf(path, sizeof(path), SYSFS_PMUS "/%s/events/%s", pmu, alias);
+   return read_line(path, terms, size);
+}
+
+static int set_pmu_event(const char *pmu, const char *spec, int is_alias, event_t *evt) {
+   char path[1024], buf[4096];
+
+   snprintf(path, sizeof(path), SYSFS_PMUS "/%s/type", pmu);
+   if (!read_line(path, buf, sizeof(buf)))
+      event_error("Unknown PMU %s", pmu);
+   evt->type = strtoull(buf, NULL, 0);
+   evt->config = 0;
+
+   if (is_alias) {
+      if (!pmu_has_alias(pmu, spec, buf, sizeof(buf)))
+         event_error("PMU %s has no event %s", pmu, spec);
+      if (apply_terms(pmu, buf, evt))
+         return -1;
+
+      snprintf(path, sizeof(path), SYSFS_PMUS "/%s/events/%s.scale", pmu, spec);
+      if (read_line(path, buf, sizeof(buf)))
+         evt->scale = atof(buf);
+      snprintf(path, sizeof(path), SYSFS_PMUS "/%s/events/%s.unit", pmu, spec);
+      if (read_line(path, buf, sizeof(buf)))
+         evt->unit = strdup(buf);
+   }
+   else if (apply_terms(pmu, spec, evt)) {
+      return -1;
+   }
+
+   /* Uncore PMUs can only be opened on the cpus of their cpumask */
+   snprintf(path, sizeof(path), SYSFS_PMUS "/%s/cpumask", pmu);
+   if (read_line(path, buf, sizeof(buf)) && buf[0])
+      evt->cpus = numa_parse_cpustring_all(buf);
+   return 1;
+}
+
+/* PMU/ALIAS/ or PMU/TERM=VALUE,.../ */
+static int parse_pmu_event(const char *name, event_t *evt) {
+   char pmu[128], spec[256];
+   const char *slash = strchr(name, '/');
+   size_t len;
+
+   if (!slash)
+      return 0;
+
+   snprintf(pmu, sizeof(pmu), "%.*s", (int) (slash - name), name);
+   snprintf(spec, sizeof(spec), "%s", slash + 1);
+   len = strlen(spec);
+   if (len && spec[len - 1] == '/')
+      spec[len - 1] = '\0';
+
+   return set_pmu_event(pmu, spec, !strchr(spec, '='), evt);
+}
+
+/* ALIAS exported by one of the PMUs (the core PMU first) */
+static int parse_pmu_alias(const char *name, event_t *evt) {
+   static const char *core_pmus[] = { "cpu", "cpu_core", "cpu_atom" };
+   char terms[4096];
+   struct dirent *entry;
+   size_t i;
+   DIR *dir;
+
+   for (i = 0; i < sizeof(core_pmus) / sizeof(*core_pmus); i++) {
+      if (pmu_has_alias(core_pmus[i], name, terms, sizeof(terms))) {
+         return set_pmu_event(core_pmus[i], name, 1, evt);
+      }
+   }
+
+   dir = opendir(SYSFS_PMUS);
+   if (!dir)
+      return 0;
+   while ((entry = readdir(dir))) {
+      if (entry->d_name[0] == '.')
+         continue;
+      if (pmu_has_alias(entry->d_name, name, terms, sizeof(terms))) {
+         int ret = set_pmu_event(entry->d_name, name, 1, evt);
+         closedir(dir);
+         return ret;
+      }
+   }
+   closedir(dir);
+   return 0;
+}
+
+/*
+ * Fills the type and config fields of evt from a raw 0x value (see README)
+ * or a symbolic name. Returns 1 on success, 0 if the name does not match
+ * any event and -1 if it matches an event that cannot be used.
+ */
+int mp_resolve_event(const char *name, event_t *evt) {
+   int i, ret;
+
+   evt->config1 = evt->config2 = 0;
+   evt->scale = 1.;
+   evt->unit = NULL;
+   evt->cpus = NULL;
+   evt->raw_code = 0;
+
+   if (!strncasecmp(name, "0x", 2)) {
+      char *end;
+
+      evt->type = PERF_TYPE_RAW;
+      evt->raw_code = 1;
+      evt->config = strtoull(name + 2, &end, 16);
+      if (end == name + 2 || *end)
+         event_error("Wrong format for counter %s. Expected 0xXXXXXX", name);
+      return 1;
+   }
+   if ((i = find_symbol(event_symbols_sw, PERF_COUNT_SW_MAX, name)) >= 0) {
+      evt->type = PERF_TYPE_SOFTWARE;
+      evt->config = i;
+      return 1;
+   }
+   if ((i = find_symbol(event_symbols_hw, PERF_COUNT_HW_MAX, name)) >= 0) {
+      evt->type = PERF_TYPE_HARDWARE;
+      evt->config = i;
+      return 1;
+   }
+
+   if ((ret = parse_hw_cache(name, evt)))
+      return ret;
+   if ((ret = parse_tracepoint(name, evt)))
+      return ret;
+   if ((ret = parse_pmu_event(name, evt)))
+      return ret;
+   return parse_pmu_alias(name, evt);
+}
+
+const char *mp_event_type_name(uint64_t type) {
+   switch (type) {
+      case PERF_TYPE_HARDWARE: return "hardware";
+      case PERF_TYPE_SOFTWARE: return "software";
+      case PERF_TYPE_TRACEPOINT: return "tracepoint";
+      case PERF_TYPE_HW_CACHE: return "cache";
+      case PERF_TYPE_RAW: return "raw";
+      default: return "pmu";
+   }
+}
+
+void mp_print_event_symbols(const char *prefix) {
+   int i;
+
+   for (i = 0; i < PERF_COUNT_SW_MAX; i++) {
+      if (event_symbols_sw[i].symbol)
+         printf("%s%s\n", prefix, event_symbols_sw[i].symbol);
+   }
+   for (i = 0; i < PERF_COUNT_HW_MAX; i++) {
+      if (event_symbols_hw[i].symbol)
+         printf("%s%s\n", prefix, event_symbols_hw[i].symbol);
+   }
+   printf("%sCACHE[.OP[.RESULT]]: CACHE = L1D, L1I, LLC, dTLB, iTLB, branch, node; OP = read, write, prefetch; RESULT = access, miss\n", prefix);
+   printf("%sSUBSYSTEM:TRACEPOINT (e.g. sched:sched_switch)\n", prefix);
+   printf("%sPMU/ALIAS/ or PMU/TERM=VALUE,.../ (see " SYSFS_PMUS "/*/events and format)\n", prefix);
+   printf("%sALIAS exported by a PMU (e.g. energy-pkg)\n", prefix);
+}
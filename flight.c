@@ -0,0 +1,151 @@
+/*
+Copyright (C) 2012
+Fabien Gaud <fgaud@sfu.ca>, Baptiste Lepers <baptiste.lepers@inria.fr>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "miniprof.h"
+
+/*
+ * Flight recorder (--flight-recorder).
+ *
+ * Each monitoring thread keeps its last samples in a circular buffer that
+ * is allocated (and touched) before sampling starts, and writes nothing.
+ * When a trigger fires (SIGUSR1 or --trigger threshold), every thread
+ * keeps sampling for post_s seconds and then dumps the samples taken
+ * between pre_s seconds before the trigger and the end of the post window,
+ * in the normal trace format.
+ *
+ * Triggers that fire while a dump is pending are merged into it.
+ */
+struct fr_sample {
+   uint64_t rdtsc;
+   uint64_t value;
+   double percent_running;
+   int evt;
+   int id;
+   int logical_time;
+   uint64_t interval;
+};
+
+struct flight_recorder {
+   struct fr_sample *samples;
+   size_t size;
+   size_t head;            /* next slot to write */
+   size_t count;
+   unsigned trigger_seen;  /* last trigger taken into account */
+   uint64_t window_start;  /* tsc of the first sample to dump */
+   uint64_t dump_at;       /* tsc of the end of the post window, 0 if no dump is pending */
+};
+
+static uint64_t pre_ticks, post_ticks;
+
+/* Written by fr_trigger, possibly from a signal handler */
+static volatile unsigned trigger_seq;
+static volatile uint64_t trigger_tsc;
+static volatile int trigger_evt = -1;
+static volatile int trigger_id;
+static volatile uint64_t trigger_value;
+static volatile unsigned trigger_printed;
+
+void fr_init(double pre_s, double post_s) {
+   pre_ticks = (uint64_t) (pre_s * tsc_frequency());
+   post_ticks = (uint64_t) (post_s * tsc_frequency());
+}
+
+struct flight_recorder *fr_create(size_t nb_samples) {
+   struct flight_recorder *fr = calloc(1, sizeof(*fr));
+
+   assert(fr && nb_samples);
+   fr->samples = malloc(nb_samples * sizeof(*fr->samples));
+   if (!fr->samples)
+      die("Cannot allocate the flight recorder (%zu samples)", nb_samples);
+
+   /* Touch the buffer now so that recording never page faults */
+   memset(fr->samples, 0, nb_samples * sizeof(*fr->samples));
+   fr->size = nb_samples;
+   fr->trigger_seen = trigger_seq;
+   return fr;
+}
+
+/*
+ * Async-signal-safe. evt is -1 for SIGUSR1, otherwise the event whose
+ * value crossed the threshold on core/tid id.
+ */
+void fr_trigger(int evt, int id, uint64_t value) {
+   uint64_t now;
+
+   rdtscll(now);
+   trigger_tsc = now;
+   trigger_evt = evt;
+   trigger_id = id;
+   trigger_value = value;
+   __sync_fetch_and_add(&trigger_seq, 1);
+}
+
+void fr_record(struct flight_recorder *fr, int evt, int id, uint64_t rdtsc, uint64_t value, double percent_running, int logical_time, uint64_t interval) {
+   struct fr_sample *s = &fr->samples[fr->head];
+
+   s->rdtsc = rdtsc;
+   s->value = value;
+   s->percent_running = percent_running;
+   s->evt = evt;
+   s->id = id;
+   s->logical_time = logical_time;
+   s->interval = interval;
+
+   fr->head = (fr->head + 1) % fr->size;
+   if (fr->count < fr->size)
+      fr->count++;
+}
+
+static void fr_dump(struct flight_recorder *fr, unsigned seq) {
+   size_t i, first = (fr->head + fr->size - fr->count) % fr->size;
+
+   /* Only one thread describes the trigger */
+   unsigned printed = trigger_printed;
+   if (printed != seq && __sync_bool_compare_and_swap(&trigger_printed, printed, seq)) {
+      if (trigger_evt == -1)
+         printf("#Flight recorder: trigger %u (SIGUSR1) at %llu\n", seq, (long long unsigned) trigger_tsc);
+      else
+         printf("#Flight recorder: trigger %u (event %d = %llu on %d) at %llu\n", seq, trigger_evt,
+               (long long unsigned) trigger_value, trigger_id, (long long unsigned) trigger_tsc);
+   }
+
+   for (i = 0; i < fr->count; i++) {
+      struct fr_sample *s = &fr->samples[(first + i) % fr->size];
+      if (s->rdtsc >= fr->window_start && s->rdtsc <= fr->dump_at)
+         dump_sample(s->evt, s->id, s->rdtsc, s->value, s->percent_running, s->logical_time, s->interval);
+   }
+   fflush(stdout);
+}
+
+/* Called by the monitoring threads after each sampling round */
+void fr_check(struct flight_recorder *fr, uint64_t now) {
+   unsigned seq = trigger_seq;
+
+   if (seq != fr->trigger_seen) {
+      if (!fr->dump_at) {
+         uint64_t tsc = trigger_tsc;
+         fr->window_start = (tsc > pre_ticks) ? tsc - pre_ticks : 0;
+         fr->dump_at = tsc + post_ticks;
+      }
+      fr->trigger_seen = seq;
+   }
+
+   if (fr->dump_at && now >= fr->dump_at) {
+      fr_dump(fr, fr->trigger_seen);
+      fr->dump_at = 0;
+   }
+}
@@ -0,0 +1,192 @@
+/*
+Copyright (C) 2012
+Fabien Gaud <fgaud@sfu.ca>, Baptiste Lepers <baptiste.lepers@inria.fr>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "miniprof.h"
+
+/*
+ * Keeps the cores out of halt states during the run (--no-idle), without
+ * burning cycles like the -ft spinning threads do.
+ *
+ * - IDLE_CONTROL_QOS: requests a 0us wakeup latency through the PM QoS
+ *   interface. The request holds as long as /dev/cpu_dma_latency is open
+ *   (the kernel drops it when miniprof exits, even when it is killed).
+ * - IDLE_CONTROL_CSTATES: disables every cpuidle state but POLL on every
+ *   cpu through sysfs. The previous values are restored at exit. A cpu
+ *   without POLL state ends up with all its states disabled, and the kernel
+ *   then uses its default idle routine (HLT): this is reported in the
+ *   description.
+ */
+extern int ncpus;
+
+struct disabled_state {
+   int cpu;
+   int state;
+   char old_value;
+};
+
+static int qos_fd = -1;
+static struct disabled_state *disabled_states;
+static int nb_disabled_states;
+static int nb_disabled_cpus;
+static int nb_cpus_without_poll;
+static int qos_errno, cstates_errno;   /* cause of the failure of each mechanism */
+static char description[256] = "none";
+
+static int enable_pm_qos(void) {
+   int32_t latency = 0;
+
+   qos_fd = open("/dev/cpu_dma_latency", O_RDWR);
+   if (qos_fd < 0) {
+      qos_errno = errno;
+      return 0;
+   }
+
+   if (write(qos_fd, &latency, sizeof(latency)) != sizeof(latency)) {
+      qos_errno = errno;
+      close(qos_fd);
+      qos_fd = -1;
+      return 0;
+   }
+   return 1;
+}
+
+/* Returns 0 with errno set on failure */
+static int write_state_disable(int cpu, int state, char value) {
+   char path[128];
+   int fd, ret, err;
+
+   snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cpuidle/state%d/disable", cpu, state);
+   fd = open(path, O_WRONLY);
+   if (fd < 0)
+      return 0;
+   ret = (write(fd, &value, 1) == 1);
+   err = errno;
+   close(fd);
+   errno = err;
+   return ret;
+}
+
+/* Returns 0 with errno set when the state does not exist */
+static int read_state(int cpu, int state, char *name, size_t size, char *disabled) {
+   char path[128];
+   FILE *f;
+
+   snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cpuidle/state%d/name", cpu, state);
+   f = fopen(path, "r");
+   if (!f)
+      return 0;
+   if (!fgets(name, size, f))
+      name[0] = '\0';
+   name[strcspn(name, "\n")] = '\0';
+   fclose(f);
+
+   snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cpuidle/state%d/disable", cpu, state);
+   f = fopen(path, "r");
+   if (!f)
+      return 0;
+   if (fscanf(f, " %c", disabled) != 1)
+      *disabled = '0';
+   fclose(f);
+   return 1;
+}
+
+static int disable_cstates(void) {
+   int cpu, state;
+
+   for (cpu = 0; cpu < ncpus; cpu++) {
+      int disabled_on_cpu = 0, has_poll = 0;
+
+      for (state = 0; ; state++) {
+         char name[32], old_value;
+
+         if (!read_state(cpu, state, name, sizeof(name), &old_value)) {
+            if (!state)
+               cstates_errno = errno;
+            break;
+         }
+         if (!strcmp(name, "POLL"))
+            has_poll = 1;
+         if (!strcmp(name, "POLL") || old_value == '1')
+            continue;
+         if (!write_state_disable(cpu, state, '1')) {
+            cstates_errno = errno;
+            fprintf(stderr, "#WARNING: cannot disable idle state %d (%s) of cpu %d\n", state, name, cpu);
+            continue;
+         }
+
+         disabled_states = realloc(disabled_states, (nb_disabled_states + 1) * sizeof(*disabled_states));
+         disabled_states[nb_disabled_states].cpu = cpu;
+         disabled_states[nb_disabled_states].state = state;
+         disabled_states[nb_disabled_states].old_value = old_value;
+         nb_disabled_states++;
+         disabled_on_cpu = 1;
+      }
+      nb_disabled_cpus += disabled_on_cpu;
+      if (disabled_on_cpu && !has_poll)
+         nb_cpus_without_poll++;
+   }
+   return nb_disabled_states > 0;
+}
+
+void idle_control_restore(void) {
+   int i;
+
+   if (qos_fd >= 0) {
+      close(qos_fd);
+      qos_fd = -1;
+   }
+
+   for (i = 0; i < nb_disabled_states; i++) {
+      write_state_disable(disabled_states[i].cpu, disabled_states[i].state, disabled_states[i].old_value);
+   }
+   nb_disabled_states = 0;
+}
+
+static const char *cstates_error(void) {
+   return cstates_errno ? strerror(cstates_errno) : "no state to disable";
+}
+
+void idle_control_enable(int mode) {
+   int qos = 0, cstates = 0, len;
+
+   if (mode & IDLE_CONTROL_QOS)
+      qos = enable_pm_qos();
+   if (mode & IDLE_CONTROL_CSTATES)
+      cstates = disable_cstates();
+
+   if (qos && cstates)
+      len = snprintf(description, sizeof(description), "pm_qos (/dev/cpu_dma_latency = 0) + cpuidle (%d states disabled on %d cpus)", nb_disabled_states, nb_disabled_cpus);
+   else if (qos)
+      len = snprintf(description, sizeof(description), "pm_qos (/dev/cpu_dma_latency = 0)");
+   else if (cstates)
+      len = snprintf(description, sizeof(description), "cpuidle (%d states disabled on %d cpus)", nb_disabled_states, nb_disabled_cpus);
+   else if (mode == IDLE_CONTROL_QOS)
+      len = snprintf(description, sizeof(description), "none (failed to control idle states: pm_qos: %s)", strerror(qos_errno));
+   else if (mode == IDLE_CONTROL_CSTATES)
+      len = snprintf(description, sizeof(description), "none (failed to control idle states: cpuidle: %s)", cstates_error());
+   else
+      len = snprintf(description, sizeof(description), "none (failed to control idle states: pm_qos: %s, cpuidle: %s)", strerror(qos_errno), cstates_error());
+
+   if (nb_cpus_without_poll && len < (int) sizeof(description))
+      snprintf(description + len, sizeof(description) - len, ", WARNING: %d cpus have no POLL state and halt in the default idle routine", nb_cpus_without_poll);
+
+   atexit(idle_control_restore);
+}
+
+const char *idle_control_description(void) {
+   return description;
+}
@@ -0,0 +1,122 @@
+/*
+Copyright (C) 2012
+Fabien Gaud <fgaud@sfu.ca>, Baptiste Lepers <baptiste.lepers@inria.fr>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "miniprof.h"
+#include "libminiprof.h"
+
+/*
+ * Counter sets of libminiprof. The first counter is the group leader: the
+ * counters are scheduled together and started/stopped at once. Counters
+ * belong to the calling thread, so they are read from their mmap page with
+ * rdpmc whenever the kernel allows it.
+ */
+struct mp_set {
+   int nb_events;
+   event_t *events;
+   struct counter *counters;
+};
+
+struct mp_set *mp_create(const char **names, int nb_events, int flags) {
+   struct mp_set *set;
+   int i, err;
+
+   if (nb_events <= 0) {
+      errno = EINVAL;
+      return NULL;
+   }
+
+   set = calloc(1, sizeof(*set));
+   if (!set)
+      return NULL;
+   set->events = calloc(nb_events, sizeof(*set->events));
+   set->counters = calloc(nb_events, sizeof(*set->counters));
+   if (!set->events || !set->counters)
+      goto error;
+   set->nb_events = nb_events;
+   for (i = 0; i < nb_events; i++)
+      set->counters[i].fd = -1;
+
+   for (i = 0; i < nb_events; i++) {
+      event_t *evt = &set->events[i];
+
+      if (mp_resolve_event(names[i], evt) <= 0) {
+         errno = EINVAL;
+         goto error;
+      }
+      evt->name = strdup(names[i]);
+      evt->cpu_filter = -1;
+      evt->exclude_kernel = !!(flags & MP_EXCLUDE_KERNEL);
+      evt->exclude_user = !!(flags & MP_EXCLUDE_USER);
+   }
+
+   for (i = 0; i < nb_events; i++) {
+      int leader = i ? set->counters[0].fd : -1;
+      if (mp_counter_open(&set->counters[i], &set->events[i], 0, -1, leader, COUNTER_MMAP | (i ? 0 : COUNTER_DISABLED)) < 0)
+         goto error;
+   }
+   return set;
+
+error:
+   err = errno;
+   mp_destroy(set);
+   errno = err;
+   return NULL;
+}
+
+int mp_start(struct mp_set *set) {
+   return ioctl(set->counters[0].fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+int mp_stop(struct mp_set *set) {
+   return ioctl(set->counters[0].fd, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+}
+
+int mp_read(struct mp_set *set, struct mp_value *values) {
+   struct perf_read_ev v;
+   int i;
+
+   for (i = 0; i < set->nb_events; i++) {
+      if (mp_counter_read(&set->counters[i], &v))
+         return -1;
+      values[i].value = v.value;
+      values[i].time_enabled = v.time_enabled;
+      values[i].time_running = v.time_running;
+   }
+   return 0;
+}
+
+int mp_nb_events(struct mp_set *set) {
+   return set->nb_events;
+}
+
+const char *mp_event_name(struct mp_set *set, int event) {
+   return set->events[event].name;
+}
+
+void mp_destroy(struct mp_set *set) {
+   int i;
+
+   if (!set)
+      return;
+   for (i = 0; set->counters && i < set->nb_events; i++) {
+      mp_counter_close(&set->counters[i]);
+      free((char *) set->events[i].name);
+   }
+   free(set->counters);
+   free(set->events);
+   free(set);
+}
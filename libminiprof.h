@@ -0,0 +1,77 @@
+/*
+Copyright (C) 2012
+Fabien Gaud <fgaud@sfu.ca>, Baptiste Lepers <baptiste.lepers@inria.fr>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef LIBMINIPROF_H_
+#define LIBMINIPROF_H_
+
+/*
+ * libminiprof: in-process self-monitoring with the events of miniprof.
+ * Link with libminiprof.a -lnuma. See README, "libminiprof".
+ *
+ *    const char *names[] = { "instructions", "L1D.read.miss" };
+ *    struct mp_set *set = mp_create(names, 2, MP_EXCLUDE_KERNEL);
+ *    struct mp_value before[2], after[2];
+ *
+ *    mp_start(set);
+ *    mp_read(set, before);
+ *    ... region ...
+ *    mp_read(set, after);
+ *    printf("%.0f instructions\n", mp_delta(&before[0], &after[0]));
+ *    mp_destroy(set);
+ */
+#include <stdint.h>
+
+/* mp_create flags */
+#define MP_EXCLUDE_KERNEL       0x1
+#define MP_EXCLUDE_USER         0x2
+
+struct mp_set;
+
+struct mp_value {
+   uint64_t value;
+   uint64_t time_enabled;
+   uint64_t time_running;
+};
+
+/*
+ * Opens a set of counters on the calling thread. Events use the same
+ * syntax as miniprof (0x raw values or symbolic names). The counters are
+ * opened as a group, stopped. Returns NULL with errno set on failure.
+ */
+struct mp_set *mp_create(const char **events, int nb_events, int flags);
+int mp_start(struct mp_set *set);
+int mp_stop(struct mp_set *set);
+
+/* Fills values[nb_events]; must be called from the thread that created the set */
+int mp_read(struct mp_set *set, struct mp_value *values);
+
+int mp_nb_events(struct mp_set *set);
+const char *mp_event_name(struct mp_set *set, int event);
+void mp_destroy(struct mp_set *set);
+
+/* Number of events between two snapshots, scaled when the counter was multiplexed */
+static inline double mp_delta(const struct mp_value *before, const struct mp_value *after) {
+   uint64_t enabled = after->time_enabled - before->time_enabled;
+   uint64_t running = after->time_running - before->time_running;
+   double value = after->value - before->value;
+
+   if (running && running < enabled)
+      value = value * enabled / running;
+   return value;
+}
+
+#endif /* LIBMINIPROF_H_ */
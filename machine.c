@@ -2,7 +2,6 @@
 
 static int msr_count;
 static struct msr *available_msrs;
-static int **available_msr_usage;
 extern int ncpus;
 
 void cpuid(unsigned info, unsigned *eax, unsigned *ebx, unsigned *ecx, unsigned *edx) {
@@ -17,11 +16,49 @@ void cpuid(unsigned info, unsigned *eax, unsigned *ebx, unsigned *ecx, unsigned
 }
 
 
+/* Set when the msr files are regular files (see msr_offset) */
+static int msr_regular_files;
+
+/*
+ * Checks once whether the msr files of a --msr-path are regular files,
+ * on the file of cpu 0: all the files of a path are of the same kind.
+ */
+void msr_detect_layout(const char *path_format) {
+   char path[256];
+   struct stat st;
+
+   snprintf(path, sizeof(path), path_format, 0);
+   msr_regular_files = !stat(path, &st) && S_ISREG(st.st_mode);
+}
+
+/*
+ * Offset of an MSR in an msr file (see --msr-path): the register number for
+ * /dev/cpu/N/msr, 8 bytes per register for regular files, whose registers
+ * would overlap otherwise.
+ */
+off_t msr_offset(uint32_t msr) {
+   if (msr_regular_files)
+      return (off_t) msr * sizeof(uint64_t);
+   return msr;
+}
+
+/* Family returned instead of the one of the cpu, when set (see bench/test_msr.c) */
+static unsigned int forced_family;
+
+void force_processor_family(unsigned int family) {
+   forced_family = family;
+   free(available_msrs);
+   available_msrs = NULL;
+}
+
 unsigned int get_processor_family() {
    char vendor[12];
    unsigned int family;
    unsigned int a, b, c, d;
 
+   if(forced_family)
+      return forced_family;
+
    cpuid(0x0, &a, (unsigned int *)vendor, (unsigned int *)(vendor + 8), (unsigned int *)(vendor + 4));
    if(memcmp(vendor, "AuthenticAMD", sizeof(vendor)))
       die("Unsupported CPU (expected AuthenticAMD, found %12.12s)\n", vendor);
@@ -86,32 +123,27 @@ void get_available_msr(void) {
    case 0x100f00: /* AMD fam10h, see AMD BKDG 10h, section 2.16.1 */
       msr_count = 4;
       available_msrs = malloc(msr_count * sizeof(*available_msrs));
-      available_msr_usage = malloc(msr_count * sizeof(*available_msr_usage));
       for(i = 0; i < msr_count; i++) {
          available_msrs[i].id = i;
          available_msrs[i].select =  0xC0010000 + i;
          available_msrs[i].value =  0xC0010000 + i + 4;
          available_msrs[i].can_be_used = can_be_used_10h;
-         available_msr_usage[i] = calloc(ncpus, sizeof(*available_msr_usage[i]));
       }
       break;
    case 0x600f00: /* 15h */
       msr_count = 10;
       available_msrs = malloc(msr_count * sizeof(*available_msrs));
-      available_msr_usage = malloc(msr_count * sizeof(*available_msr_usage));
       for(i = 0; i < 6; i++) {
          available_msrs[i].id = i;
          available_msrs[i].select =  0xC0010200 + 2 * i;
          available_msrs[i].value =  0xC0010200 + 2 * i + 1;
          available_msrs[i].can_be_used = can_be_used_15h;
-         available_msr_usage[i] = calloc(ncpus, sizeof(*available_msr_usage[i]));
       }
       for(i = 6; i < msr_count; i++) {
          available_msrs[i].id = i;
          available_msrs[i].select =  0xC0010240 + 2 * (i - 6);
          available_msrs[i].value =  0xC0010240 + 2 * (i - 6) + 1;
          available_msrs[i].can_be_used = can_be_used_15h;
-         available_msr_usage[i] = calloc(ncpus, sizeof(*available_msr_usage[i]));
       }
       break;
    default:
@@ -119,48 +151,236 @@ void get_available_msr(void) {
    }
 }
 
-int is_reserved(int msr_id, uint64_t evt, int cpu_filter) {
+/*
+ * Counter scheduling.
+ *
+ * Each raw event must get one MSR, usable for this event, and two events
+ * cannot share a MSR if they are monitored on a same cpu (per-node events
+ * are monitored on all the cpus of their node). There are at most 10 MSRs,
+ * so the assignment is searched by backtracking over (event, MSR), the
+ * events with the fewest usable MSRs first. MSRs held by no event and
+ * usable by the same events are interchangeable: only one of them is tried
+ * at each step, which keeps infeasible sets fast to reject. Unlike a greedy assignment,
+ * this finds an assignment whenever one exists, whatever the order of the
+ * events on the command line.
+ */
+struct msr_schedule {
+   event_t **events;
+   int nb_events;
+   char *conflicts;     /* conflicts[i * nb_events + j]: i and j share a cpu */
+   int *assignment;     /* msr of each event, -1 when not assigned */
+   int *order;          /* events in the order in which they are assigned */
+   char *equivalent;    /* equivalent[a * msr_count + b]: same usable events */
+};
+
+/* cpus[i] is set when the event is monitored on cpu i */
+static void get_event_cpus(event_t *evt, char *cpus) {
    int i;
-   int per_node = is_per_node(evt);
+   int per_node = is_per_node(evt->config);
 
    for(i = 0; i < ncpus; i++) {
-      if(available_msr_usage[msr_id][i] // msr has been configured on cpu i
-            && ((cpu_filter == -1)      // and we want to use it on all cpu
-               || (cpu_filter == i)     // or on this cpu
-               || (per_node && (numa_node_of_cpu(cpu_filter) == numa_node_of_cpu(i))))) // or on the same node (and it is a problem)
+      cpus[i] = (evt->cpu_filter == -1 || evt->cpu_filter == i
+            || (per_node && numa_node_of_cpu(evt->cpu_filter) == numa_node_of_cpu(i)));
+   }
+}
+
+static int usable(struct msr_schedule *sched, int evt, int msr_id) {
+   return available_msrs[msr_id].can_be_used(&available_msrs[msr_id], sched->events[evt]->config);
+}
+
+static int nb_usable(struct msr_schedule *sched, int evt) {
+   int msr_id, nb = 0;
+
+   for(msr_id = 0; msr_id < msr_count; msr_id++)
+      nb += usable(sched, evt, msr_id);
+   return nb;
+}
+
+/* Returns the event monitored on the same cpus as evt that holds msr_id, or -1 */
+static int holder(struct msr_schedule *sched, int evt, int msr_id) {
+   int i;
+
+   for(i = 0; i < sched->nb_events; i++) {
+      if(i != evt && sched->assignment[i] == msr_id && sched->conflicts[evt * sched->nb_events + i])
+         return i;
+   }
+   return -1;
+}
+
+static int unused(struct msr_schedule *sched, int msr_id) {
+   int i;
+
+   for(i = 0; i < sched->nb_events; i++) {
+      if(sched->assignment[i] == msr_id)
+         return 0;
+   }
+   return 1;
+}
+
+/* Assigns the events order[depth..nb-1], returns 0 when it is not possible */
+static int backtrack(struct msr_schedule *sched, int depth, int nb) {
+   int msr_id, tried, evt;
+
+   if(depth == nb)
+      return 1;
+   evt = sched->order[depth];
+
+   /* Search in reverse to try MSR 5-3 first on 15h (they accept fewer events) */
+   for(msr_id = msr_count - 1; msr_id >= 0; msr_id--) {
+      if(!usable(sched, evt, msr_id) || holder(sched, evt, msr_id) != -1)
+         continue;
+      if(unused(sched, msr_id)) {
+         for(tried = msr_count - 1; tried > msr_id; tried--) {
+            if(sched->equivalent[tried * msr_count + msr_id] && unused(sched, tried) && usable(sched, evt, tried))
+               break;
+         }
+         if(tried > msr_id)
+            continue;
+      }
+      sched->assignment[evt] = msr_id;
+      if(backtrack(sched, depth + 1, nb))
          return 1;
+      sched->assignment[evt] = -1;
    }
    return 0;
 }
 
-void reserve_msr(int msr_id, uint64_t evt, int cpu_filter) {
-   int i;
-   int per_node = is_per_node(evt);
+/*
+ * Finds an assignment of the first nb events of the command line. Returns
+ * 0, and keeps the previous assignment, when there is none.
+ */
+static int assign_first_events(struct msr_schedule *sched, int nb) {
+   int *saved = malloc(sched->nb_events * sizeof(*saved));
+   int i, j, ret;
 
-   for(i = 0; i < ncpus; i++) {
-      if(cpu_filter == -1 || cpu_filter == i
-               || (per_node && (numa_node_of_cpu(cpu_filter) == numa_node_of_cpu(i))))
-         available_msr_usage[msr_id][i] = 1;
+   /* Insertion sort: most constrained events first, ties in command line order */
+   for(i = 0; i < nb; i++) {
+      int u = nb_usable(sched, i);
+
+      for(j = i; j > 0 && nb_usable(sched, sched->order[j - 1]) > u; j--)
+         sched->order[j] = sched->order[j - 1];
+      sched->order[j] = i;
+   }
+
+   memcpy(saved, sched->assignment, sched->nb_events * sizeof(*saved));
+   for(i = 0; i < nb; i++)
+      sched->assignment[i] = -1;
+   ret = backtrack(sched, 0, nb);
+   if(!ret)
+      memcpy(sched->assignment, saved, sched->nb_events * sizeof(*saved));
+   free(saved);
+   return ret;
+}
+
+/* Prints the counters usable by an event, e.g. "3-5" or "0-2,6" */
+static void describe_usable_msrs(struct msr_schedule *sched, int evt, char *buf, size_t size) {
+   int msr_id, len = 0;
+
+   buf[0] = '\0';
+   for(msr_id = 0; msr_id < msr_count; msr_id++) {
+      int last;
+
+      if(!usable(sched, evt, msr_id))
+         continue;
+      for(last = msr_id; last + 1 < msr_count && usable(sched, evt, last + 1); last++);
+
+      if(last == msr_id)
+         len += snprintf(buf + len, size - len, "%s%d", len ? "," : "", msr_id);
+      else
+         len += snprintf(buf + len, size - len, "%s%d-%d", len ? "," : "", msr_id, last);
+      msr_id = last;
    }
 }
 
-/* Returns a MSR for a performance monitoring counter. */
-struct msr *get_msr(uint64_t evt, uint64_t cpu_filter) {
+/*
+ * Called when evt cannot be added to the events before it: there is no
+ * assignment in which one of its usable msrs is free on its cpus. Lists the
+ * events holding these msrs in the assignment of the previous events.
+ */
+static void schedule_failed(struct msr_schedule *sched, int evt) {
+   char buf[64];
    int i;
 
+   describe_usable_msrs(sched, evt, buf, sizeof(buf));
+   if(!buf[0])
+      die("No counter can monitor event %s (%llx) on this processor", sched->events[evt]->name, (long long unsigned)sched->events[evt]->config);
+
+   fprintf(stderr, "Cannot find a free counter for event %s (%llx): it can only use counter(s) %s,\n",
+         sched->events[evt]->name, (long long unsigned)sched->events[evt]->config, buf);
+   fprintf(stderr, "which are needed by the following events monitored on the same cpus:\n");
+   for(i = 0; i < sched->nb_events; i++) {
+      if(i == evt || sched->assignment[i] == -1 || !sched->conflicts[evt * sched->nb_events + i] || !usable(sched, evt, sched->assignment[i]))
+         continue;
+      describe_usable_msrs(sched, i, buf, sizeof(buf));
+      fprintf(stderr, "\t%s (%llx): counter %d, can use counter(s) %s\n", sched->events[i]->name,
+            (long long unsigned)sched->events[i]->config, sched->assignment[i], buf);
+   }
+   die("No free msr for event %llx", (long long unsigned)sched->events[evt]->config);
+}
+
+/* Assigns a MSR to each raw event (see the comment of struct msr_schedule). */
+void assign_msrs(event_t *events, int nb_events) {
+   struct msr_schedule sched;
+   char *cpus;
+   int i, j, k;
+
    get_available_msr();
 
-   /* Perform search in reverse to increase the chance to use MSR 5-3 on 15h */
-   /* because these counters can be used on a limited subset of events       */
-   for(i = msr_count - 1; i >= 0; i--) {
-      if(!is_reserved(i, evt, cpu_filter) && available_msrs[i].can_be_used(&available_msrs[i], evt)) {
-         struct msr *msr = malloc(sizeof(*msr));
-         memcpy(msr, &available_msrs[i], sizeof(*msr));
-         return msr;
+   sched.nb_events = 0;
+   sched.events = malloc(nb_events * sizeof(*sched.events));
+   for(i = 0; i < nb_events; i++) {
+      if(events[i].raw_code)
+         sched.events[sched.nb_events++] = &events[i];
+   }
+
+   cpus = malloc(sched.nb_events * ncpus);
+   for(i = 0; i < sched.nb_events; i++)
+      get_event_cpus(sched.events[i], &cpus[i * ncpus]);
+
+   sched.conflicts = calloc(sched.nb_events * sched.nb_events, 1);
+   for(i = 0; i < sched.nb_events; i++) {
+      for(j = 0; j < sched.nb_events; j++) {
+         for(k = 0; k < ncpus; k++) {
+            if(cpus[i * ncpus + k] && cpus[j * ncpus + k]) {
+               sched.conflicts[i * sched.nb_events + j] = 1;
+               break;
+            }
+         }
       }
    }
 
-   die("No free msr for event %llx", (long long unsigned)evt);
-   return 0;
-}
+   sched.assignment = malloc(sched.nb_events * sizeof(*sched.assignment));
+   for(i = 0; i < sched.nb_events; i++)
+      sched.assignment[i] = -1;
 
+   sched.equivalent = malloc(msr_count * msr_count);
+   for(i = 0; i < msr_count; i++) {
+      for(j = 0; j < msr_count; j++) {
+         sched.equivalent[i * msr_count + j] = 1;
+         for(k = 0; k < sched.nb_events; k++) {
+            if(usable(&sched, k, i) != usable(&sched, k, j))
+               sched.equivalent[i * msr_count + j] = 0;
+         }
+      }
+   }
+
+   /* Add the events one by one, to name the first one that does not fit */
+   sched.order = malloc(sched.nb_events * sizeof(*sched.order));
+   for(i = 0; i < sched.nb_events; i++) {
+      if(!assign_first_events(&sched, i + 1))
+         schedule_failed(&sched, i);
+   }
+
+   for(i = 0; i < sched.nb_events; i++) {
+      struct msr *msr = &available_msrs[sched.assignment[i]];
+      sched.events[i]->msr_select = msr->select;
+      sched.events[i]->msr_value = msr->value;
+   }
+
+   free(sched.events);
+   free(sched.conflicts);
+   free(sched.assignment);
+   free(sched.order);
+   free(sched.equivalent);
+   free(cpus);
+}
@@ -0,0 +1,545 @@
+/*
+Copyright (C) 2012
+Fabien Gaud <fgaud@sfu.ca>, Baptiste Lepers <baptiste.lepers@inria.fr>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * miniprof-diff: compares two (sets of) miniprof traces.
+ *
+ * For each event (matched by name using the #Event headers) and each node,
+ * the traces are turned into a distribution of rates (events per second)
+ * over the sampling intervals. The rate of a node during an interval is
+ * the sum of the rates of its cores. The distributions of the baseline and
+ * of the candidate are then compared with a bootstrap confidence interval
+ * of the difference of the means and a Mann-Whitney U test.
+ *
+ * Traces are read line by line. Each distribution is summarized by its
+ * exact mean/variance and a fixed-size reservoir of samples, so memory does
+ * not depend on the size of the traces.
+ */
+#include "miniprof.h"
+#include <math.h>
+
+#define DEFAULT_RESERVOIR_SIZE  2000
+#define BOOTSTRAP_ITERATIONS    1000
+#define WINDOW                  16      /* logical times being aggregated per event */
+#define ALL_NODES               -1
+
+/* Exit status */
+#define STATUS_REGRESSION       1
+#define STATUS_INCOMPLETE       3       /* an event or node cannot be compared */
+
+/* Distribution of the rate of an event on a node, for one set of traces */
+struct dist {
+   char *event;
+   int node;
+   uint64_t n;
+   double mean, m2;                     /* Welford */
+   double *reservoir;
+   int reservoir_len;
+};
+
+/* Pending per-node sums of an event for one logical time */
+struct slot {
+   int logical_time;
+   double *rates;                       /* index 0: all nodes, i + 1: node i */
+   char *present;
+};
+
+/* State of one trace being parsed */
+struct trace {
+   uint64_t clock;
+   int nb_events;
+   char **event_names;
+   int per_core;                        /* second column is a core (not a tid) */
+   int nb_nodes;
+   int nb_cores;
+   int *node_of_core;
+   struct slot *slots;                  /* nb_events * WINDOW */
+   int nb_last;
+   struct last_sample { int evt, id; uint64_t ts; } *last;
+   int last_size;
+};
+
+static int reservoir_size = DEFAULT_RESERVOIR_SIZE;
+static double alpha = 0.05;
+static double threshold = 1.;           /* in percents */
+static int nb_higher_is_better;
+static char **higher_is_better;
+static uint64_t late_samples;
+
+static struct dist *dists[2];
+static int nb_dists[2];
+
+static uint64_t rand_state = 88172645463325252ULL;
+
+static uint64_t xorshift(void) {
+   rand_state ^= rand_state << 13;
+   rand_state ^= rand_state >> 7;
+   rand_state ^= rand_state << 17;
+   return rand_state;
+}
+
+static struct dist *get_dist(int set, const char *event, int node) {
+   int i;
+
+   for (i = 0; i < nb_dists[set]; i++) {
+      if (dists[set][i].node == node && !strcmp(dists[set][i].event, event))
+         return &dists[set][i];
+   }
+
+   dists[set] = realloc(dists[set], (nb_dists[set] + 1) * sizeof(**dists));
+   struct dist *d = &dists[set][nb_dists[set]++];
+   memset(d, 0, sizeof(*d));
+   d->event = strdup(event);
+   d->node = node;
+   d->reservoir = malloc(reservoir_size * sizeof(*d->reservoir));
+   return d;
+}
+
+static void add_sample(struct dist *d, double x) {
+   double delta = x - d->mean;
+
+   d->n++;
+   d->mean += delta / d->n;
+   d->m2 += delta * (x - d->mean);
+
+   /* Reservoir sampling: every sample has the same probability to be kept */
+   if (d->reservoir_len < reservoir_size)
+      d->reservoir[d->reservoir_len++] = x;
+   else {
+      uint64_t j = xorshift() % d->n;
+      if (j < (uint64_t) reservoir_size)
+         d->reservoir[j] = x;
+   }
+}
+
+/*
+ * Per (event, core/tid) timestamp of the previous sample, used to compute
+ * the length of the interval. Open addressing, grows when half full.
+ */
+static struct last_sample *find_last(struct trace *t, int evt, int id) {
+   unsigned h;
+
+   if (2 * (t->nb_last + 1) > t->last_size) {
+      struct last_sample *old = t->last;
+      int i, old_size = t->last_size;
+
+      t->last_size = old_size ? 2 * old_size : 1024;
+      t->last = malloc(t->last_size * sizeof(*t->last));
+      for (i = 0; i < t->last_size; i++)
+         t->last[i].evt = -1;
+      t->nb_last = 0;
+      for (i = 0; i < old_size; i++) {
+         if (old[i].evt != -1) {
+            struct last_sample *l = find_last(t, old[i].evt, old[i].id);
+            l->ts = old[i].ts;
+         }
+      }
+      free(old);
+   }
+
+   h = ((unsigned) evt * 2654435761U ^ (unsigned) id * 40503U) % t->last_size;
+   while (t->last[h].evt != -1 && (t->last[h].evt != evt || t->last[h].id != id))
+      h = (h + 1) % t->last_size;
+
+   if (t->last[h].evt == -1) {
+      t->last[h].evt = evt;
+      t->last[h].id = id;
+      t->last[h].ts = 0;
+      t->nb_last++;
+   }
+   return &t->last[h];
+}
+
+static void flush_slot(struct trace *t, int set, int evt, struct slot *s) {
+   int n;
+
+   if (s->logical_time < 0)
+      return;
+   for (n = 0; n <= t->nb_nodes; n++) {
+      if (s->present[n])
+         add_sample(get_dist(set, t->event_names[evt], n - 1), s->rates[n]);
+   }
+   s->logical_time = -1;
+}
+
+static void init_slots(struct trace *t) {
+   int i;
+
+   t->slots = calloc(t->nb_events * WINDOW, sizeof(*t->slots));
+   for (i = 0; i < t->nb_events * WINDOW; i++) {
+      t->slots[i].logical_time = -1;
+      t->slots[i].rates = calloc(t->nb_nodes + 1, sizeof(double));
+      t->slots[i].present = calloc(t->nb_nodes + 1, 1);
+   }
+}
+
+static void add_line(struct trace *t, int set, int evt, int id, uint64_t ts, uint64_t value, int logical_time) {
+   struct last_sample *last;
+   struct slot *s;
+   double rate;
+   int node;
+
+   if (evt < 0 || evt >= t->nb_events || !t->event_names[evt])
+      return;
+   if (!t->slots)
+      init_slots(t);
+
+   /* The first value of a counter covers an unknown interval */
+   last = find_last(t, evt, id);
+   if (!last->ts || ts <= last->ts) {
+      last->ts = ts;
+      return;
+   }
+   rate = (double) value * t->clock / (double) (ts - last->ts);
+   last->ts = ts;
+
+   s = &t->slots[evt * WINDOW + logical_time % WINDOW];
+   if (s->logical_time != logical_time) {
+      if (s->logical_time > logical_time) {
+         late_samples++;
+         return;
+      }
+      flush_slot(t, set, evt, s);
+      s->logical_time = logical_time;
+      memset(s->rates, 0, (t->nb_nodes + 1) * sizeof(double));
+      memset(s->present, 0, t->nb_nodes + 1);
+   }
+
+   s->rates[0] += rate;
+   s->present[0] = 1;
+   node = (t->per_core && id >= 0 && id < t->nb_cores) ? t->node_of_core[id] : -1;
+   if (node >= 0 && node < t->nb_nodes) {
+      s->rates[node + 1] += rate;
+      s->present[node + 1] = 1;
+   }
+}
+
+static void parse_trace(const char *path, int set) {
+   struct trace t;
+   char *line = NULL;
+   size_t len = 0;
+   FILE *f;
+   int i, evt;
+
+   f = fopen(path, "r");
+   if (!f)
+      die("Cannot open %s: %s", path, strerror(errno));
+
+   memset(&t, 0, sizeof(t));
+   while (getline(&line, &len, f) != EOF) {
+      int id, logical_time, node, n;
+      long long unsigned ts, value, clock;
+      double percent_running;
+      char name[256];
+
+      if (line[0] != '#') {
+         /* Traces may contain other output (e.g. stderr of miniprof-launch.pl) */
+         if (sscanf(line, "%d\t%d\t%llu\t%llu\t%lf\t%d", &evt, &id, &ts, &value, &percent_running, &logical_time) != 6)
+            continue;
+         if (!t.clock)
+            die("%s: missing #Clock speed header", path);
+         add_line(&t, set, evt, id, ts, value, logical_time);
+      }
+      else if (!strncmp(line, "#Event\tCore\t", 12)) {
+         t.per_core = 1;
+      }
+      else if (sscanf(line, "#Clock speed: %llu", &clock) == 1) {
+         t.clock = clock;
+      }
+      else if (sscanf(line, "#Event %d: %255[^(](", &evt, name) == 2 && !t.slots) {
+         name[strcspn(name, " ")] = '\0';
+         if (evt >= t.nb_events) {
+            t.event_names = realloc(t.event_names, (evt + 1) * sizeof(*t.event_names));
+            for (i = t.nb_events; i <= evt; i++)
+               t.event_names[i] = NULL;
+            t.nb_events = evt + 1;
+         }
+         t.event_names[evt] = strdup(name);
+      }
+      else if (sscanf(line, "#Node %d :%n", &node, &n) == 1 && !t.slots) {
+         char *p = line + n;
+         int core, consumed;
+
+         if (node >= t.nb_nodes)
+            t.nb_nodes = node + 1;
+         while (sscanf(p, "%d%n", &core, &consumed) == 1) {
+            if (core >= t.nb_cores) {
+               t.node_of_core = realloc(t.node_of_core, (core + 1) * sizeof(*t.node_of_core));
+               for (i = t.nb_cores; i <= core; i++)
+                  t.node_of_core[i] = -1;
+               t.nb_cores = core + 1;
+            }
+            t.node_of_core[core] = node;
+            p += consumed;
+         }
+      }
+   }
+
+   /*
+    * miniprof is killed in the middle of a sweep, so the newest logical
+    * time of each event usually misses some cores: drop it, it would be a
+    * low outlier of the per-node and 'all' rates.
+    */
+   for (evt = 0; t.slots && evt < t.nb_events; evt++) {
+      struct slot *slots = &t.slots[evt * WINDOW], *newest = NULL;
+
+      for (i = 0; i < WINDOW; i++) {
+         if (slots[i].logical_time >= 0 && (!newest || slots[i].logical_time > newest->logical_time))
+            newest = &slots[i];
+      }
+      for (i = 0; i < WINDOW; i++) {
+         if (&slots[i] != newest)
+            flush_slot(&t, set, evt, &slots[i]);
+      }
+   }
+
+   fclose(f);
+   free(line);
+   for (i = 0; t.slots && i < t.nb_events * WINDOW; i++) {
+      free(t.slots[i].rates);
+      free(t.slots[i].present);
+   }
+   for (i = 0; i < t.nb_events; i++)
+      free(t.event_names[i]);
+   free(t.event_names);
+   free(t.slots);
+   free(t.node_of_core);
+   free(t.last);
+}
+
+static int cmp_double(const void *a, const void *b) {
+   double x = *(const double *) a, y = *(const double *) b;
+   return (x > y) - (x < y);
+}
+
+/* Two-sided p-value of the Mann-Whitney U test (normal approximation with tie correction) */
+static double mann_whitney(struct dist *a, struct dist *b) {
+   int na = a->reservoir_len, nb = b->reservoir_len, n = na + nb, i, j;
+   struct { double v; int set; } *all = malloc(n * sizeof(*all));
+   double rank_sum_a = 0, ties = 0, u, mu, sigma;
+
+   for (i = 0; i < na; i++) { all[i].v = a->reservoir[i]; all[i].set = 0; }
+   for (i = 0; i < nb; i++) { all[na + i].v = b->reservoir[i]; all[na + i].set = 1; }
+   qsort(all, n, sizeof(*all), cmp_double);
+
+   for (i = 0; i < n; i = j) {
+      double rank;
+      for (j = i; j < n && all[j].v == all[i].v; j++);
+      rank = (i + 1 + j) / 2.;                  /* average rank of the ties */
+      ties += pow(j - i, 3) - (j - i);
+      for (; i < j; i++) {
+         if (all[i].set == 0)
+            rank_sum_a += rank;
+      }
+   }
+   free(all);
+
+   u = rank_sum_a - na * (na + 1) / 2.;
+   mu = na * (double) nb / 2.;
+   sigma = sqrt(na * (double) nb / 12. * ((n + 1) - ties / ((double) n * (n - 1))));
+   if (sigma == 0)
+      return 1.;
+   return erfc(fabs(u - mu) / sigma / sqrt(2.));
+}
+
+static double reservoir_mean(struct dist *d) {
+   double sum = 0;
+   int i;
+   for (i = 0; i < d->reservoir_len; i++)
+      sum += d->reservoir[i];
+   return sum / d->reservoir_len;
+}
+
+/*
+ * 95% bootstrap confidence interval of mean(b) - mean(a). The resampling
+ * is done on the reservoirs; the interval is then centered on the exact
+ * difference of the means.
+ */
+static void bootstrap(struct dist *a, struct dist *b, double *low, double *high) {
+   double *diffs = malloc(BOOTSTRAP_ITERATIONS * sizeof(*diffs));
+   double center = reservoir_mean(b) - reservoir_mean(a);
+   int it, i;
+
+   for (it = 0; it < BOOTSTRAP_ITERATIONS; it++) {
+      double sa = 0, sb = 0;
+      for (i = 0; i < a->reservoir_len; i++)
+         sa += a->reservoir[xorshift() % a->reservoir_len];
+      for (i = 0; i < b->reservoir_len; i++)
+         sb += b->reservoir[xorshift() % b->reservoir_len];
+      diffs[it] = sb / b->reservoir_len - sa / a->reservoir_len;
+   }
+   qsort(diffs, BOOTSTRAP_ITERATIONS, sizeof(*diffs), cmp_double);
+   *low = (b->mean - a->mean) + diffs[(int) (BOOTSTRAP_ITERATIONS * 0.025)] - center;
+   *high = (b->mean - a->mean) + diffs[(int) (BOOTSTRAP_ITERATIONS * 0.975) - 1] - center;
+   free(diffs);
+}
+
+static int is_higher_better(const char *event) {
+   int i;
+   for (i = 0; i < nb_higher_is_better; i++) {
+      if (!strcmp(higher_is_better[i], event))
+         return 1;
+   }
+   return 0;
+}
+
+static int cmp_dist(const void *x, const void *y) {
+   const struct dist *a = x, *b = y;
+   int c = strcmp(a->event, b->event);
+   return c ? c : a->node - b->node;
+}
+
+/*
+ * Returns STATUS_REGRESSION when a significant regression is found,
+ * STATUS_INCOMPLETE when an event or node cannot be compared (missing from
+ * one side or not enough samples), 0 otherwise.
+ */
+static int compare(void) {
+   int i, nb_regressions = 0, nb_incomplete = 0;
+
+   qsort(dists[0], nb_dists[0], sizeof(*dists[0]), cmp_dist);
+   printf("#Event\t\t\tNode\tN(A)\tN(B)\tMean(A)/s\tMean(B)/s\tDelta\t95%% CI\t\t\tp-value\n");
+
+   for (i = 0; i < nb_dists[0]; i++) {
+      struct dist *a = &dists[0][i], *b = NULL;
+      double low, high, p, delta;
+      char node[16];
+      int j, significant;
+
+      for (j = 0; j < nb_dists[1]; j++) {
+         if (dists[1][j].node == a->node && !strcmp(dists[1][j].event, a->event))
+            b = &dists[1][j];
+      }
+
+      if (a->node == ALL_NODES)
+         snprintf(node, sizeof(node), "all");
+      else
+         snprintf(node, sizeof(node), "%d", a->node);
+
+      if (!b || a->n < 2 || b->n < 2) {
+         printf("%-23s\t%s\t%llu\t%llu\tnot enough samples to compare\n", a->event, node,
+               (long long unsigned) a->n, (long long unsigned) (b ? b->n : 0));
+         nb_incomplete++;
+         continue;
+      }
+
+      bootstrap(a, b, &low, &high);
+      p = mann_whitney(a, b);
+      delta = b->mean - a->mean;
+      significant = (p < alpha) && (low > 0 || high < 0)
+         && (a->mean == 0 || fabs(delta / a->mean) * 100. >= threshold);
+
+      printf("%-23s\t%s\t%llu\t%llu\t%.4g\t%.4g\t", a->event, node,
+            (long long unsigned) a->n, (long long unsigned) b->n, a->mean, b->mean);
+      if (a->mean != 0)
+         printf("%+.2f%%\t[%+.2f%%, %+.2f%%]\t", delta / a->mean * 100., low / a->mean * 100., high / a->mean * 100.);
+      else
+         printf("%+.4g\t[%+.4g, %+.4g]\t", delta, low, high);
+      printf("%.3g", p);
+
+      if (significant) {
+         int regression = is_higher_better(a->event) ? (delta < 0) : (delta > 0);
+         printf("\t%s", regression ? "REGRESSION" : "improvement");
+         nb_regressions += regression;
+      }
+      printf("\n");
+   }
+
+   for (i = 0; i < nb_dists[1]; i++) {
+      int j, found = 0;
+      for (j = 0; j < nb_dists[0]; j++) {
+         if (dists[0][j].node == dists[1][i].node && !strcmp(dists[0][j].event, dists[1][i].event))
+            found = 1;
+      }
+      if (!found) {
+         char node[16];
+
+         if (dists[1][i].node == ALL_NODES)
+            snprintf(node, sizeof(node), "all");
+         else
+            snprintf(node, sizeof(node), "%d", dists[1][i].node);
+         printf("%-23s\t%s\t0\t%llu\tonly in the candidate traces\n", dists[1][i].event, node, (long long unsigned) dists[1][i].n);
+         nb_incomplete++;
+      }
+   }
+
+   if (late_samples)
+      printf("#WARNING: %llu samples ignored (out of order by more than %d intervals)\n", (long long unsigned) late_samples, WINDOW);
+   if (nb_incomplete)
+      printf("#WARNING: %d rows could not be compared\n", nb_incomplete);
+   if (nb_regressions)
+      return STATUS_REGRESSION;
+   return nb_incomplete ? STATUS_INCOMPLETE : 0;
+}
+
+static void usage(char *name) {
+   printf("Usage: %s [options] BASELINE CANDIDATE\n", name);
+   printf("       %s [options] BASELINE... -- CANDIDATE...\n", name);
+   printf("Compares the per-event and per-node rates of two (sets of) miniprof traces.\n");
+   printf("Exits with status %d when a significant regression is found, and with status %d when an event\n", STATUS_REGRESSION, STATUS_INCOMPLETE);
+   printf("or a node cannot be compared (only in one set of traces, or less than 2 samples).\n\n");
+   printf("-a ALPHA\n\tsignificance level of the Mann-Whitney test (default: %g)\n", alpha);
+   printf("-t PERCENT\n\tignore differences smaller than PERCENT of the baseline mean (default: %g)\n", threshold);
+   printf("-g EVENT\n\thigher is better for EVENT (by default, an increase is a regression)\n");
+   printf("-r SIZE\n\tnumber of samples kept per distribution for the tests (default: %d)\n", DEFAULT_RESERVOIR_SIZE);
+   exit(2);
+}
+
+int main(int argc, char **argv) {
+   int i, set = 0, first_file, nb_files[2] = { 0, 0 }, separator = 0;
+
+   for (i = 1; i < argc && argv[i][0] == '-' && strcmp(argv[i], "--"); i += 2) {
+      if (i + 1 >= argc)
+         usage(argv[0]);
+      if (!strcmp(argv[i], "-a"))
+         alpha = atof(argv[i + 1]);
+      else if (!strcmp(argv[i], "-t"))
+         threshold = atof(argv[i + 1]);
+      else if (!strcmp(argv[i], "-r"))
+         reservoir_size = atoi(argv[i + 1]);
+      else if (!strcmp(argv[i], "-g")) {
+         higher_is_better = realloc(higher_is_better, (nb_higher_is_better + 1) * sizeof(*higher_is_better));
+         higher_is_better[nb_higher_is_better++] = argv[i + 1];
+      }
+      else
+         usage(argv[0]);
+   }
+   if (reservoir_size < 2)
+      usage(argv[0]);
+
+   first_file = i;
+   for (; i < argc; i++) {
+      if (!strcmp(argv[i], "--"))
+         separator++;
+      else
+         nb_files[!!separator]++;
+   }
+   if (separator > 1 || (!separator && nb_files[0] != 2) || (separator && (!nb_files[0] || !nb_files[1])))
+      usage(argv[0]);
+
+   for (i = first_file; i < argc; i++) {
+      if (!strcmp(argv[i], "--")) {
+         set = 1;
+         continue;
+      }
+      parse_trace(argv[i], set);
+      if (!separator)
+         set = 1;
+   }
+
+   return compare();
+}
@@ -10,11 +10,21 @@ my ($output, $first_app_arg);
 sub HELP_MESSAGE() {
    print "Usage:\tminiprof-exec [-o miniprof-output-file] [-<miniprof option> <miniprof arg>] ./app <args>\n";
    print "\tSupported miniprof options:\n";
-   print "\t\t-e NAME COUNTER KERNEL USER PER_DIE\n";
+   print "\t\t-e NAME[@PERIOD_MS] COUNTER KERNEL USER PER_DIE\n";
    print "\t\t-c NB_CORES\n";
    print "\t\t-t TID\n";
+   print "\t\t-p PERIOD_MS\n";
+   print "\t\t--flight-recorder HISTORY_S PRE_S POST_S\n";
+   print "\t\t--trigger NAME THRESHOLD\n";
    print "\t\t-a APPLICATION\n";
+   print "\t\t--collectors NB_COLLECTORS\n";
+   print "\t\t--aggregate-comm\n";
    print "\t\t-ft\n";
+   print "\t\t--no-idle qos|cstates|all\n";
+   print "\t\t--ns\n";
+   print "\t\t--numa-report\n";
+   print "\t\t--power auto|perf|msr\n";
+   print "\t\t--msr-path FORMAT\n";
    exit;
 }
 
@@ -33,8 +43,18 @@ for (my $index = 0; !defined $first_app_arg;) {
       case "-e" { $index += 6; }
       case "-c" { $index += 2; }
       case "-t" { $index += 2; }
+      case "-p" { $index += 2; }
+      case "--flight-recorder" { $index += 4; }
+      case "--trigger" { $index += 3; }
       case "-a" { $index += 2; }
+      case "--collectors" { $index += 2; }
+      case "--aggregate-comm" { $index += 1; }
       case "-ft" { $index += 1; }
+      case "--no-idle" { $index += 2; }
+      case "--ns" { $index += 1; }
+      case "--numa-report" { $index += 1; }
+      case "--power" { $index += 2; }
+      case "--msr-path" { $index += 2; }
       else { $first_app_arg = $index; }
    }
 }
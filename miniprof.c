@@ -27,15 +27,28 @@ int * cores_monitoring_node_events;
 /* sampling period (time interval between two dumps of the performance counters) */
 static int sleep_time = 1000 * TIME_MSECOND;
 
+/* flight recorder: samples kept in memory and dumped around triggers */
+static int with_flight_recorder = 0;
+static double fr_history_s, fr_pre_s, fr_post_s;
+static int trigger_event = -1;
+static uint64_t trigger_threshold;
+
 static event_t *events = NULL;
 static int nb_events = 0;
 
 static int nb_observed_pids = 0;
 static int *observed_pids;
 
-static long sys_perf_counter_open(struct perf_event_attr *hw_event, pid_t pid, int cpu, int group_fd, unsigned long flags);
+/* per-tid profiling: number of collector threads sharing the observed tids */
+static int nb_collectors = DEFAULT_NB_COLLECTORS;
+
+/* per-tid profiling: sum the counters of the threads that have the same comm */
+static int aggregate_by_comm = 0;
+static int nb_comm_groups = 0;
+static char **comm_groups;
+static int *observed_groups; /* comm group of each observed tid */
+
 
-static uint64_t hex2u64(const char *ptr);
 static void sig_handler(int signal);
 static int wrmsr(int cpu, uint32_t msr, uint64_t val);
 static uint64_t rdmsr(int cpu, uint32_t msr);
@@ -43,53 +56,20 @@ static void stop_all_pmu(void);
 static void disable_nmi_watchdog(void);
 
 static int with_fake_threads = 0;
+static int idle_control = 0;
+static int with_ns_timestamps = 0;
+static int with_multi_rate = 0;
+static int with_numa_report = 0;
+static int telemetry_sources = 0;
+
+/* Path of the MSR devices, %d is the cpu (see --msr-path) */
+const char *msr_path = DEFAULT_MSR_PATH;
 
 static int global_exclude_kernel = 0;
 static int global_exclude_user = 0;
 static int global_use_msr = 0;
 
 
-// This code is directly imported from <linux_src>/tools/perf/util/parse-events.c
-struct event_symbol {
-   const char  *symbol;                                                                                                                                                                                       
-};
-
-static struct event_symbol event_symbols_sw[PERF_COUNT_SW_MAX] = {
-   [PERF_COUNT_SW_CPU_CLOCK] = {
-      .symbol = "cpu-clock",
-   },
-   [PERF_COUNT_SW_TASK_CLOCK] = {
-      .symbol = "task-clock",
-   },
-   [PERF_COUNT_SW_PAGE_FAULTS] = {
-      .symbol = "page-faults",
-   },
-   [PERF_COUNT_SW_CONTEXT_SWITCHES] = {
-      .symbol = "context-switches",
-   },
-   [PERF_COUNT_SW_CPU_MIGRATIONS] = {
-      .symbol = "cpu-migrations",
-   },
-   [PERF_COUNT_SW_PAGE_FAULTS_MIN] = {
-      .symbol = "minor-faults",
-   },
-   [PERF_COUNT_SW_PAGE_FAULTS_MAJ] = {
-      .symbol = "major-faults",
-   },
-#ifdef PERF_COUNT_SW_ALIGNMENT_FAULTS
-   [PERF_COUNT_SW_ALIGNMENT_FAULTS] = {
-      .symbol = "alignment-faults",
-   },
-#endif
-#ifdef PERF_COUNT_SW_EMULATION_FAULTS
-   [PERF_COUNT_SW_EMULATION_FAULTS] = {
-      .symbol = "emulation-faults",
-   },
-#endif
-};
-
-
-
 uint64_t get_cpu_freq(void) {
    FILE *fd;
    uint64_t freq = 0;
@@ -134,12 +114,121 @@ int get_tids_of_app(char *app) {
          add_tid(pid);
       }
    }
-   fclose(procs);
+   pclose(procs);
 
    return nb_tids_found;
 }
 
-static pid_t gettid(void) {
+/*
+ * Name of the comm group of a thread: its comm without the trailing
+ * number, so that e.g. "GC Thread#0" and "GC Thread#1" end up together.
+ */
+static void get_comm_group_name(int tid, char *name, size_t size) {
+   char path[64];
+   size_t len;
+   FILE *f;
+
+   snprintf(path, sizeof(path), "/proc/%d/comm", tid);
+   f = fopen(path, "r");
+   if (!f || !fgets(name, size, f)) {
+      snprintf(name, size, "<exited>");
+      if (f)
+         fclose(f);
+      return;
+   }
+   fclose(f);
+
+   len = strcspn(name, "\n");
+   while (len > 1 && strchr("0123456789#-_/:. ", name[len - 1]))
+      len--;
+   name[len] = '\0';
+}
+
+void group_tids_by_comm(void) {
+   int i, g;
+   char name[64];
+
+   observed_groups = malloc(nb_observed_pids * sizeof(*observed_groups));
+   for (i = 0; i < nb_observed_pids; i++) {
+      get_comm_group_name(observed_pids[i], name, sizeof(name));
+      for (g = 0; g < nb_comm_groups; g++) {
+         if (!strcmp(comm_groups[g], name))
+            break;
+      }
+      if (g == nb_comm_groups) {
+         comm_groups = realloc(comm_groups, (nb_comm_groups + 1) * sizeof(*comm_groups));
+         comm_groups[nb_comm_groups++] = strdup(name);
+      }
+      observed_groups[i] = g;
+   }
+}
+
+/*
+ * Distributes the observed tids among the collectors. With --aggregate-comm
+ * all the threads of a comm group go to the same collector (the least loaded
+ * one), otherwise tids are distributed round robin.
+ */
+pdata_t *shard_tids(int nb_shards) {
+   int i, c;
+   int *owner = malloc(nb_observed_pids * sizeof(*owner));
+   int *group_owner = malloc(nb_comm_groups * sizeof(*group_owner));
+   pdata_t *shards = calloc(nb_shards, sizeof(*shards));
+
+   for (i = 0; i < nb_comm_groups; i++)
+      group_owner[i] = -1;
+
+   for (i = 0; i < nb_observed_pids; i++) {
+      if (!aggregate_by_comm) {
+         owner[i] = i % nb_shards;
+      }
+      else {
+         int g = observed_groups[i];
+         if (group_owner[g] == -1) {
+            group_owner[g] = 0;
+            for (c = 1; c < nb_shards; c++) {
+               if (shards[c].nb_tids < shards[group_owner[g]].nb_tids)
+                  group_owner[g] = c;
+            }
+         }
+         owner[i] = group_owner[g];
+      }
+      shards[owner[i]].nb_tids++;
+   }
+
+   for (c = 0; c < nb_shards; c++) {
+      shards[c].tids = malloc(shards[c].nb_tids * sizeof(*shards[c].tids));
+      shards[c].nb_tids = 0;
+   }
+   for (i = 0; i < nb_observed_pids; i++) {
+      pdata_t *shard = &shards[owner[i]];
+      shard->tids[shard->nb_tids++] = i;
+   }
+
+   free(owner);
+   free(group_owner);
+   return shards;
+}
+
+/* Per-tid profiling needs one fd per observed tid and per event */
+static void raise_fd_limit(rlim_t needed) {
+   struct rlimit rl;
+
+   if (getrlimit(RLIMIT_NOFILE, &rl) || rl.rlim_cur >= needed)
+      return;
+
+   rl.rlim_cur = needed;
+   if (rl.rlim_max != RLIM_INFINITY && rl.rlim_max < needed)
+      rl.rlim_max = needed; /* requires CAP_SYS_RESOURCE */
+
+   if (setrlimit(RLIMIT_NOFILE, &rl)) {
+      getrlimit(RLIMIT_NOFILE, &rl);
+      rl.rlim_cur = rl.rlim_max;
+      setrlimit(RLIMIT_NOFILE, &rl);
+      printf("#WARNING: cannot open more than %llu files (%llu needed)\n", (long long unsigned) rl.rlim_cur, (long long unsigned) needed);
+   }
+}
+
+static pid_t miniprof_gettid(void) {
    return syscall(__NR_gettid);
 }
 
@@ -164,7 +253,7 @@ void set_affinity(int tid, int core_id) {
 void* spin_loop(void *pdata) {
    pdata_t *data = (pdata_t*) pdata;
 
-   pid_t tid = gettid();
+   pid_t tid = miniprof_gettid();
    set_affinity(tid, data->core);
    if(setpriority(PRIO_PROCESS, tid, 20)){
       perror("Error while setting priority");
@@ -174,23 +263,39 @@ void* spin_loop(void *pdata) {
    return NULL;
 }
 
+/*
+ * Dumps one line of the trace (see README for the format).
+ * The optional columns are appended so that the position of the other
+ * fields does not change.
+ */
+void dump_sample(int evt, int id, uint64_t rdtsc, uint64_t value, double percent_running, int logical_time, uint64_t interval) {
+   char extra[64];
+   int len = 0;
+
+   extra[0] = '\0';
+   if (with_ns_timestamps)
+      len += snprintf(extra + len, sizeof(extra) - len, "\t%llu", (long long unsigned) tsc_to_ns(rdtsc));
+   if (with_multi_rate)
+      len += snprintf(extra + len, sizeof(extra) - len, "\t%llu", (long long unsigned) tsc_delta_to_ns(interval));
+
+   printf("%d\t%d\t%llu\t%llu\t%.3f\t%d%s\n", evt, id, (long long unsigned) rdtsc, (long long unsigned) value, percent_running, logical_time, extra);
+}
+
 /*
  * Routine executed by the miniprof threads in order to periodically dump
- * the state of the performance counters.
+ * the state of the performance counters of a core.
  *
  * Note that the same per-core (resp. per-node) counters are monitored on
  * all cores (resp. nodes).
  */
 static void* thread_loop(void *pdata) {
-   int i, watch_tid;
+   int i;
    uint64_t event_mask;
    pdata_t *data = (pdata_t*) pdata;
-   watch_tid = (data->tid != 0);
 
-   struct perf_event_attr * event_attr = calloc(nb_events, sizeof(struct perf_event_attr));
-   int * fd = (int*) malloc(nb_events * sizeof(int));
+   struct counter *counters = calloc(nb_events, sizeof(*counters));
 
-   assert(fd && event_attr);
+   assert(counters);
 
    int monitor_node_events = 0;
    for (i = 0; i < nnodes; i++) {
@@ -198,17 +303,21 @@ static void* thread_loop(void *pdata) {
          monitor_node_events = 1;
    }
 
-   if (!watch_tid) {
-      set_affinity(gettid(), data->core);
+   set_affinity(miniprof_gettid(), data->core);
+
+   /* Events monitored by this thread */
+   char *active = calloc(nb_events, 1);
+   for (i = 0; i < nb_events; i++) {
+      active[i] = !(events[i].per_node && !monitor_node_events)
+         && !(events[i].cpu_filter != -1 && data->core != events[i].cpu_filter)
+         && !(events[i].cpus && !numa_bitmask_isbitset(events[i].cpus, data->core));
    }
 
    for (i = 0; i < nb_events; i++) {
-      if (events[i].per_node && !monitor_node_events) 
-         continue;
-      if (events[i].cpu_filter != -1 && data->core != events[i].cpu_filter) 
+      if (!active[i])
          continue;
 
-      if(events[i].type == PERF_TYPE_RAW && global_use_msr) {
+      if(events[i].raw_code && global_use_msr) {
          event_mask = events[i].config;
          event_mask |= 0x530000; /* see README */
          if(events[i].exclude_kernel)
@@ -220,44 +329,49 @@ static void* thread_loop(void *pdata) {
          wrmsr(data->core, events[i].msr_value, 0);
       }
       else {
-         event_attr[i].size = sizeof(struct perf_event_attr);
-         event_attr[i].type = events[i].type;
-         event_attr[i].config = events[i].config;
-         event_attr[i].exclude_kernel = events[i].exclude_kernel;
-         event_attr[i].exclude_user = events[i].exclude_user;
+         /* The thread is pinned on the core: counters can be read with rdpmc */
+         if (mp_counter_open(&counters[i], &events[i], -1, data->core, -1, COUNTER_MMAP) < 0) {
+            thread_die("#[%d] mp_sys_perf_counter_open failed for counter %s: %s", data->core, events[i].name, strerror(errno));
+         }
+      }
+   }
 
-         event_attr[i].read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+   struct scheduler *sched = scheduler_create(events, nb_events, active);
 
-         fd[i] = sys_perf_counter_open(&event_attr[i], watch_tid ? data->tid : -1, watch_tid ? -1 : data->core, -1, 0);
-         if (fd[i] < 0) {
-            thread_die("#[%d] sys_perf_counter_open failed for counter %s: %s", watch_tid ? data->tid : data->core, events[i].name, strerror(errno));
-         }
+   struct flight_recorder *fr = NULL;
+   if (with_flight_recorder) {
+      size_t nb_samples = 0;
+      for (i = 0; i < nb_events; i++) {
+         if (active[i])
+            nb_samples += (size_t) (fr_history_s * TIME_SECOND / events[i].period + 1);
       }
+      if (nb_samples)
+         fr = fr_create(nb_samples);
    }
 
    struct perf_read_ev *last_counts = calloc(nb_events, sizeof(struct perf_read_ev));
-   int logical_time = 0;
    while (1) {
+      struct event_group *group = scheduler_next(sched);
       struct perf_read_ev single_count;
-      uint64_t rdtsc;
+      uint64_t rdtsc, interval;
+      int j;
 
-      logical_time++;
+      if (!group)
+         continue;
 
       rdtscll(rdtsc);
-      for (i = 0; i < nb_events; i++) {
+      interval = rdtsc - group->last_tsc;
+      group->last_tsc = rdtsc;
+      for (j = 0; j < group->nb_events; j++) {
          double percent_running = 1.;
          uint64_t value;
 
-         if (events[i].per_node && !monitor_node_events) 
-            continue;
-         if (events[i].cpu_filter != -1 && data->core != events[i].cpu_filter) 
-            continue;
-
-         if(events[i].type == PERF_TYPE_RAW && global_use_msr) {
+         i = group->events[j];
+         if(events[i].raw_code && global_use_msr) {
             single_count.value = rdmsr(data->core, events[i].msr_value);
          }
          else {
-            assert(read(fd[i], &single_count, sizeof(single_count)) == sizeof(single_count));
+            assert(mp_counter_read(&counters[i], &single_count) == 0);
 
             uint64_t time_running = single_count.time_running - last_counts[i].time_running;
             uint64_t time_enabled = single_count.time_enabled - last_counts[i].time_enabled;
@@ -267,31 +381,194 @@ static void* thread_loop(void *pdata) {
          value = single_count.value - last_counts[i].value;
          last_counts[i] = single_count;
 
-         printf("%d\t%d\t%llu\t%llu\t%.3f\t%d\n", i, watch_tid ? data->tid : data->core, (long long unsigned) rdtsc, (long long unsigned) value, percent_running, logical_time);
+         if (with_numa_report)
+            numa_report_sample(i, data->core, value, percent_running, interval, group->logical_time);
+
+         if (fr) {
+            fr_record(fr, i, data->core, rdtsc, value, percent_running, group->logical_time, interval);
+            if (i == trigger_event && value > trigger_threshold && group->logical_time > 1)
+               fr_trigger(i, data->core, value);
+         }
+         else {
+            dump_sample(i, data->core, rdtsc, value, percent_running, group->logical_time, interval);
+         }
       }
 
-      usleep(sleep_time);
+      if (fr)
+         fr_check(fr, rdtsc);
    }
 
    return NULL;
 }
 
-void usage (char ** argv) {
-   int i;
+/*
+ * Opens the events of a scheduler group on a tid (fd is the array of the
+ * fds of the tid). The events are opened as one perf group, so that they
+ * are all read with a single read() on the first one. When they do not fit
+ * in the PMU together, they are opened as separate counters that the kernel
+ * multiplexes and read one by one.
+ * Returns 1 if the events are grouped, 0 if they are not, -1 if the tid exited.
+ */
+static int open_tid_events(int tid, struct event_group *group, int *fd) {
+   struct counter counter;
+   int j, k, err, grouped = 1;
+
+   for (j = 0; j < group->nb_events; j++) {
+      int i = group->events[j];
+      int leader = (grouped && j) ? fd[group->events[0]] : -1;
 
-   printf("Usage: %s [-e NAME COUNTER EXCLUDE_KERNEL EXCLUDE_USERLAND CPU_FILTER] [-ft] [-h]\n", argv[0]);
+      fd[i] = mp_counter_open(&counter, &events[i], tid, -1, leader, grouped ? COUNTER_GROUP_READ : 0);
+      if (fd[i] >= 0)
+         continue;
+
+      err = errno;
+      if (err != ESRCH && (!grouped || !j))
+         thread_die("#[%d] mp_sys_perf_counter_open failed for counter %s: %s", tid, events[i].name, strerror(err));
+      for (k = 0; k < j; k++) {
+         close(fd[group->events[k]]);
+         fd[group->events[k]] = -1;
+      }
+      if (err == ESRCH)
+         return -1;
+      grouped = 0;
+      j = -1;
+   }
+   return grouped;
+}
+
+/*
+ * Routine executed by the collector threads for per-tid profiling (-t/-a).
+ *
+ * The observed tids are sharded among a fixed number of collectors. Each
+ * collector reads the counters of all its tids in one sweep per period,
+ * so the number of miniprof threads does not grow with the number of
+ * observed threads. With --aggregate-comm, a collector owns whole comm
+ * groups and dumps one line per group instead of one line per tid.
+ *
+ * The events of a tid that share a sampling period form a perf group, so
+ * a sweep costs one read() per tid instead of one per tid and per event.
+ */
+static void* collector_loop(void *pdata) {
+   int t, s, g, i;
+   pdata_t *data = (pdata_t*) pdata;
+   int nb_slots = 0;
+
+   char *active = malloc(nb_events);
+   memset(active, 1, nb_events);
+   struct scheduler *sched = scheduler_create(events, nb_events, active);
+
+   /* A slot is a line of output: a tid, or a comm group with --aggregate-comm */
+   int *slot_ids = malloc(data->nb_tids * sizeof(*slot_ids));
+   int *slot_of_tid = malloc(data->nb_tids * sizeof(*slot_of_tid));
+   int *fd = malloc(data->nb_tids * nb_events * sizeof(*fd));
+   char *grouped = calloc(data->nb_tids * sched->nb_groups, 1);
+   struct perf_read_ev *counts = malloc(nb_events * sizeof(*counts));
+   struct perf_read_ev *last_counts = calloc(data->nb_tids * nb_events, sizeof(*last_counts));
+   struct perf_read_ev *sums = calloc(data->nb_tids * nb_events, sizeof(*sums));
+
+   assert(slot_ids && slot_of_tid && fd && grouped && counts && last_counts && sums);
+
+   for (t = 0; t < data->nb_tids; t++) {
+      int tid = observed_pids[data->tids[t]];
+
+      if (aggregate_by_comm) {
+         int group = observed_groups[data->tids[t]];
+         for (s = 0; s < nb_slots && slot_ids[s] != group; s++);
+         if (s == nb_slots)
+            slot_ids[nb_slots++] = group;
+      }
+      else {
+         s = nb_slots++;
+         slot_ids[s] = tid;
+      }
+      slot_of_tid[t] = s;
+
+      for (i = 0; i < nb_events; i++)
+         fd[t * nb_events + i] = -1;
+      for (g = 0; g < sched->nb_groups; g++) {
+         int ret = open_tid_events(tid, &sched->groups[g], &fd[t * nb_events]);
+         if (ret < 0) {
+            printf("#WARNING: thread %d exited before being monitored\n", tid);
+            for (i = 0; i < nb_events; i++) {
+               if (fd[t * nb_events + i] >= 0)
+                  close(fd[t * nb_events + i]);
+               fd[t * nb_events + i] = -1;
+            }
+            break;
+         }
+         grouped[t * sched->nb_groups + g] = ret;
+      }
+   }
+
+   while (1) {
+      struct event_group *group = scheduler_next(sched);
+      uint64_t rdtsc, interval;
+      int j;
+
+      if (!group)
+         continue;
+
+      g = group - sched->groups;
+      rdtscll(rdtsc);
+      interval = rdtsc - group->last_tsc;
+      group->last_tsc = rdtsc;
+      for (s = 0; s < nb_slots; s++) {
+         for (j = 0; j < group->nb_events; j++)
+            memset(&sums[s * nb_events + group->events[j]], 0, sizeof(*sums));
+      }
+
+      for (t = 0; t < data->nb_tids; t++) {
+         int *tid_fd = &fd[t * nb_events];
+
+         if (tid_fd[group->events[0]] < 0)
+            continue;
+
+         if (grouped[t * sched->nb_groups + g]) {
+            assert(mp_counter_read_group(tid_fd[group->events[0]], group->nb_events, counts) == 0);
+         }
+         else {
+            for (j = 0; j < group->nb_events; j++)
+               assert(read(tid_fd[group->events[j]], &counts[j], sizeof(counts[j])) == sizeof(counts[j]));
+         }
+
+         for (j = 0; j < group->nb_events; j++) {
+            i = group->events[j];
+            struct perf_read_ev *last = &last_counts[t * nb_events + i];
+            struct perf_read_ev *sum = &sums[slot_of_tid[t] * nb_events + i];
+
+            sum->value += counts[j].value - last->value;
+            sum->time_enabled += counts[j].time_enabled - last->time_enabled;
+            sum->time_running += counts[j].time_running - last->time_running;
+            *last = counts[j];
+         }
+      }
+
+      for (s = 0; s < nb_slots; s++) {
+         for (j = 0; j < group->nb_events; j++) {
+            i = group->events[j];
+            struct perf_read_ev *sum = &sums[s * nb_events + i];
+            double percent_running = sum->time_enabled ? (double) sum->time_running / (double) sum->time_enabled : 1.;
+
+            dump_sample(i, slot_ids[s], rdtsc, sum->value, percent_running, group->logical_time, interval);
+         }
+      }
+   }
+
+   return NULL;
+}
+
+void usage (char ** argv) {
+   printf("Usage: %s [-e NAME COUNTER EXCLUDE_KERNEL EXCLUDE_USERLAND CPU_FILTER] [-s COUNTER EXCLUDE_KERNEL EXCLUDE_USERLAND] [-ft] [-h]\n", argv[0]);
    printf("-e: hardware events\n");
-   printf("\tNAME: You can give any name to the counter\n");
-   printf("\tCOUNTER: Same format as raw perf events, except that it starts by 0x instead of r\n");
+   printf("\tNAME: You can give any name to the counter. NAME@PERIOD_MS samples the event every PERIOD_MS ms instead of the default period\n");
+   printf("\tCOUNTER: Same format as raw perf events, except that it starts by 0x instead of r, or a symbolic event (see -s)\n");
    printf("\tEXCLUDE_KERNEL: Do not include kernel-level samples when sety\n");
    printf("\tEXCLUDE_USER: Do not include user-level samples\n");
    printf("\tCPU_FILTER: 0=monitor on all cores, 1=monitor on 1 cpu per node, -X=monitor only on cpu X\n\n");
 
-   printf("-s: software events\n");
-   printf("\tCOUNTER: Must be a software event. Supported events are:\n");
-   for (i = 0; i < PERF_COUNT_SW_MAX; i++) {
-      printf("\t\t%s\n", event_symbols_sw[i].symbol); 
-   } 
+   printf("-s: symbolic events\n");
+   printf("\tCOUNTER: Name of the event, also used as the name of the counter (COUNTER@PERIOD_MS to use a specific sampling period). Supported events are:\n");
+   mp_print_event_symbols("\t\t");
    printf("\tEXCLUDE_KERNEL: Do not include kernel-level samples\n");
    printf("\tEXCLUDE_USER: Do not include user-level samples\n\n");
 
@@ -301,11 +578,59 @@ void usage (char ** argv) {
    printf("-a\n");
    printf("\tAPP_NAME: same as -t but with the application name\n");
 
+   printf("-p\n");
+   printf("\tPERIOD_MS: sampling period in milliseconds (default: %d)\n\n", sleep_time / TIME_MSECOND);
+
+   printf("--flight-recorder HISTORY_S PRE_S POST_S\n");
+   printf("\tkeep the last HISTORY_S seconds of samples in memory and write nothing. On a trigger (SIGUSR1 or --trigger),\n");
+   printf("\twrite the samples from PRE_S seconds before the trigger to POST_S seconds after it (per-core profiling only)\n\n");
+
+   printf("--trigger EVENT_NAME THRESHOLD\n");
+   printf("\twith --flight-recorder, trigger a dump when EVENT_NAME counts more than THRESHOLD events in a period on a core\n\n");
+
+   printf("--collectors\n");
+   printf("\tNB_COLLECTORS: number of threads reading the counters of the observed TIDs (default: %d)\n\n", DEFAULT_NB_COLLECTORS);
+
+   printf("--aggregate-comm\n");
+   printf("\twith -t/-a, sum the counters of the threads that have the same name (ignoring trailing numbers)\n\n");
+
    printf("-ft: fake threads (put threads that spinloop with low priority on all cores)\n\n");
 
+   printf("--no-idle qos|cstates|all\n");
+   printf("\tkeep the cores out of halt states without spinning: hold /dev/cpu_dma_latency at 0 (qos),\n");
+   printf("\tdisable the cpuidle states of all cpus (cstates) or both (all). Restored at exit.\n\n");
+
    printf("--exclude-kernel\n--exclude-user\n\tglobal switches (override per event switches)\n");
 
    printf("--use-msr\n\tForce using msr directly instead of the perf API (AMD 10h and 15h only)\n");
+
+   printf("--numa-report\n\tAdd DRAM and HyperTransport per-node events and print a node x node traffic matrix with the locality of each node\n");
+   printf("\tat each period and a summary at exit (AMD 10h and 15h only)\n");
+
+   printf("--power auto|perf|msr\n\tprint the effective frequency of each core (APERF/MPERF) and the RAPL energy of each domain at each period,\n");
+   printf("\tand the total energy at exit. Read from the msr and power PMUs (perf), the MSRs (msr), or the PMUs when available (auto)\n");
+
+   printf("--msr-path FORMAT\n\tpath of the MSR devices, %%d being replaced by the cpu (default: %s)\n", msr_path);
+
+   printf("--ns\n\tAppend a timestamp in nanoseconds since the epoch (CLOCK_REALTIME) to each line\n");
+}
+
+/*
+ * Event names may end with @PERIOD_MS to sample the event with its own
+ * period. Returns the name without the suffix.
+ */
+static char *parse_event_name(const char *arg, int *period) {
+   char *name = strdup(arg);
+   char *at = strrchr(name, '@');
+
+   *period = 0;
+   if (at) {
+      *at = '\0';
+      *period = (int) (atof(at + 1) * TIME_MSECOND);
+      if (*period <= 0)
+         die("Invalid sampling period for event %s\n", arg);
+   }
+   return name;
 }
 
 void parse_options(int argc, char **argv) {
@@ -318,9 +643,13 @@ void parse_options(int argc, char **argv) {
             die("Missing argument for -e NAME COUNTER EXCLUDE_KERNEL EXCLUDE_USER CPU_FILTER\n");
                 
          events = realloc(events, (nb_events + 1) * sizeof(*events));
-         events[nb_events].name = strdup(argv[i + 1]);
-         events[nb_events].type = PERF_TYPE_RAW;
-         events[nb_events].config = hex2u64(argv[i + 2]);
+         events[nb_events].name = parse_event_name(argv[i + 1], &events[nb_events].period);
+         switch (mp_resolve_event(argv[i + 2], &events[nb_events])) {
+         case 0:
+            die("Unknown event %s (see -h for the supported events)\n", argv[i + 2]);
+         case -1:
+            exit(1);
+         }
          events[nb_events].exclude_kernel = atoi(argv[i + 3]);
          events[nb_events].exclude_user = atoi(argv[i + 4]);
          events[nb_events].exclude_user = atoi(argv[i + 4]);
@@ -332,34 +661,21 @@ void parse_options(int argc, char **argv) {
          i += 6;
       }
       else if (!strcmp(argv[i], "-s")) {
-         int j;
-
          if (i + 3 >= argc)
             die("Missing argument for -e COUNTER EXCLUDE_KERNEL EXCLUDE_USER\n");
          events = realloc(events, (nb_events + 1) * sizeof(*events));
-         events[nb_events].name = strdup(argv[i + 1]);
-         events[nb_events].type = PERF_TYPE_SOFTWARE;
-
-         events[nb_events].per_node = 0;
-         events[nb_events].cpu_filter = -1;
-
-         // Looking for the event number
-         for (j = 0; j < PERF_COUNT_SW_MAX; j++) {
-            if(! strcmp(event_symbols_sw[j].symbol, argv[i + 1]))
-               break;
-         } 
-
-         if(j == PERF_COUNT_SW_MAX) {
-            printf("\n%s is not a valid software event\n", argv[i + 1]);
+         events[nb_events].name = parse_event_name(argv[i + 1], &events[nb_events].period);
+         switch (mp_resolve_event(events[nb_events].name, &events[nb_events])) {
+         case -1:
+            exit(1);
+         case 0:
+            printf("\n%s is not a valid event\n", events[nb_events].name);
             printf("Supported events are:\n");
-            for (j = 0; j < PERF_COUNT_SW_MAX; j++) {
-               printf("\t%s\n", event_symbols_sw[j].symbol);
-            } 
-
+            mp_print_event_symbols("\t");
             exit(1);
          }
-        
-         events[nb_events].config = j;
+         events[nb_events].per_node = 0;
+         events[nb_events].cpu_filter = -1;
          events[nb_events].exclude_kernel = atoi(argv[i + 2]);
          events[nb_events].exclude_user = atoi(argv[i + 3]);
          nb_events++;
@@ -380,12 +696,70 @@ void parse_options(int argc, char **argv) {
          get_tids_of_app(argv[i + 1]);
          i += 2;
       }
+      else if (!strcmp(argv[i], "-p")) {
+         if (i + 1 >= argc)
+            die("Missing argument for -p PERIOD_MS\n");
+         sleep_time = (int) (atof(argv[i + 1]) * TIME_MSECOND);
+         if (sleep_time <= 0)
+            die("Invalid sampling period: %s\n", argv[i + 1]);
+         i += 2;
+      }
+      else if (!strcmp(argv[i], "--flight-recorder")) {
+         if (i + 3 >= argc)
+            die("Missing argument for --flight-recorder HISTORY_S PRE_S POST_S\n");
+         with_flight_recorder = 1;
+         fr_history_s = atof(argv[i + 1]);
+         fr_pre_s = atof(argv[i + 2]);
+         fr_post_s = atof(argv[i + 3]);
+         if (fr_history_s <= 0 || fr_pre_s < 0 || fr_post_s < 0 || fr_pre_s + fr_post_s > fr_history_s)
+            die("Invalid flight recorder windows (PRE_S + POST_S must not exceed HISTORY_S)\n");
+         i += 4;
+      }
+      else if (!strcmp(argv[i], "--trigger")) {
+         int j;
+
+         if (i + 2 >= argc)
+            die("Missing argument for --trigger EVENT_NAME THRESHOLD\n");
+         for (j = 0; j < nb_events; j++) {
+            if (!strcmp(events[j].name, argv[i + 1]))
+               trigger_event = j;
+         }
+         if (trigger_event == -1)
+            die("--trigger: unknown event %s (events must be defined before --trigger)\n", argv[i + 1]);
+         trigger_threshold = strtoull(argv[i + 2], NULL, 0);
+         i += 3;
+      }
+      else if (!strcmp(argv[i], "--collectors")) {
+         if (i + 1 >= argc)
+            die("Missing argument for --collectors NB_COLLECTORS\n");
+         nb_collectors = atoi(argv[i + 1]);
+         if (nb_collectors <= 0)
+            die("Invalid number of collectors: %s\n", argv[i + 1]);
+         i += 2;
+      }
+      else if (!strcmp(argv[i], "--aggregate-comm")) {
+         aggregate_by_comm = 1;
+         i++;
+      }
       else if (!strcmp(argv[i], "-ft")) {
          with_fake_threads = 1;
          /* see spin_loop for details */
          printf("#WARNING: with fake threads\n");
          i++;
       }
+      else if (!strcmp(argv[i], "--no-idle")) {
+         if (i + 1 >= argc)
+            die("Missing argument for --no-idle qos|cstates|all\n");
+         if (!strcmp(argv[i + 1], "qos"))
+            idle_control = IDLE_CONTROL_QOS;
+         else if (!strcmp(argv[i + 1], "cstates"))
+            idle_control = IDLE_CONTROL_CSTATES;
+         else if (!strcmp(argv[i + 1], "all"))
+            idle_control = IDLE_CONTROL_QOS | IDLE_CONTROL_CSTATES;
+         else
+            die("Unknown --no-idle mode %s (expected qos, cstates or all)\n", argv[i + 1]);
+         i += 2;
+      }
       else if (!strcmp(argv[i], "--exclude-user")) {
          global_exclude_user = 1;
          printf("#WARNING: global exclude user set\n");
@@ -400,6 +774,38 @@ void parse_options(int argc, char **argv) {
          global_use_msr = 1;
          i++;
       }
+      else if (!strcmp(argv[i], "--numa-report")) {
+         with_numa_report = 1;
+         i++;
+      }
+      else if (!strcmp(argv[i], "--power")) {
+         if (i + 1 >= argc)
+            die("Missing argument for --power auto|perf|msr\n");
+         if (!strcmp(argv[i + 1], "perf"))
+            telemetry_sources = TELEMETRY_PERF;
+         else if (!strcmp(argv[i + 1], "msr"))
+            telemetry_sources = TELEMETRY_MSR;
+         else if (!strcmp(argv[i + 1], "auto"))
+            telemetry_sources = TELEMETRY_PERF | TELEMETRY_MSR;
+         else
+            die("Unknown --power source %s (expected auto, perf or msr)\n", argv[i + 1]);
+         i += 2;
+      }
+      else if (!strcmp(argv[i], "--msr-path")) {
+         const char *conv;
+
+         if (i + 1 >= argc)
+            die("Missing argument for --msr-path FORMAT\n");
+         conv = strchr(argv[i + 1], '%');
+         if (!conv || conv[1] != 'd' || strchr(conv + 1, '%'))
+            die("Invalid --msr-path %s (expected exactly one %%d, e.g. /dev/cpu/%%d/msr)\n", argv[i + 1]);
+         msr_path = argv[i + 1];
+         i += 2;
+      }
+      else if (!strcmp(argv[i], "--ns")) {
+         with_ns_timestamps = 1;
+         i++;
+      }
       else if (!strcmp(argv[i], "-h")) {
          usage(argv);
          exit(0);
@@ -430,27 +836,54 @@ int main(int argc, char**argv) {
 
    // Parse options
    parse_options(argc, argv);
-   if(!nb_events) {
+   if(with_numa_report) {
+      if(nb_observed_pids > 0)
+         die("--numa-report only supports per-core profiling");
+      if(global_use_msr)
+         die("--numa-report needs more NB counters than available and cannot be used with --use-msr");
+      nb_events += numa_report_add_events(&events, nb_events);
+   }
+   if(!nb_events && (!telemetry_sources || nb_observed_pids)) {
       usage(argv);
       die("No events defined");
    }
+   for(i = 0; i < nb_events; i++) {
+      if(!events[i].period)
+         events[i].period = sleep_time;
+      if(events[i].period != sleep_time)
+         with_multi_rate = 1;
+   }
+   if(trigger_event != -1 && !with_flight_recorder) {
+      die("--trigger requires --flight-recorder");
+   }
+   if(with_flight_recorder && nb_observed_pids > 0) {
+      die("The flight recorder only supports per-core profiling");
+   }
 
    for(i = 0; global_use_msr && i < nb_events; i++) {
-      if(events[i].type == PERF_TYPE_RAW) {
-         struct msr *msr = get_msr(events[i].config, events[i].cpu_filter);
-         events[i].msr_select = msr->select;
-         events[i].msr_value = msr->value;
-         reserve_msr(msr->id, events[i].config, events[i].cpu_filter);
-
-         if(nb_observed_pids > 0) {
-            die("Cannot filter by application name/pid and use MSR at the same time");
-         }
+      if(events[i].raw_code && nb_observed_pids > 0) {
+         die("Cannot filter by application name/pid and use MSR at the same time");
+      }
+   }
+   if(global_use_msr) {
+      assign_msrs(events, nb_events);
+   }
+
+   /* Load the kernel module for MSR access, or check what the files of --msr-path are */
+   if(global_use_msr || (telemetry_sources & TELEMETRY_MSR)) {
+      if(!strcmp(msr_path, DEFAULT_MSR_PATH)) {
+         if(system("sudo modprobe msr")) {};
+      }
+      else {
+         msr_detect_layout(msr_path);
       }
    }
 
-   /* Load the kernel module for MSR access */
-   if(global_use_msr && system("sudo modprobe msr")) {};
 
+   if (idle_control) {
+      idle_control_enable(idle_control);
+      printf("#Idle control: %s\n", idle_control_description());
+   }
 
    printf("#NB cpus :\t%d\n", ncpus);
    printf("#NB nodes :\t%d\n", nnodes);
@@ -478,10 +911,27 @@ int main(int argc, char**argv) {
       numa_free_cpumask(bm);
    }
 
-   uint64_t clk_speed = get_cpu_freq();
-
-   /* Print CPU clock speed */
-   printf("#Clock speed: %llu\n", (long long unsigned) clk_speed);
+   /*
+    * Print the TSC frequency. It used to be the current "cpu MHz" of
+    * /proc/cpuinfo, which is wrong as soon as frequency scaling kicks in.
+    */
+   uint64_t anchor_tsc, anchor_ns;
+   tsc_calibrate();
+   tsc_anchor(&anchor_tsc, &anchor_ns);
+   printf("#Clock speed: %llu\n", (long long unsigned) tsc_frequency());
+   printf("#Clock calibration: %s (cpu MHz at startup: %llu)\n", tsc_calibration_source(), (long long unsigned) get_cpu_freq() / 1000000);
+   printf("#TSC anchor: %llu\t%llu.%09llu\n", (long long unsigned) anchor_tsc,
+         (long long unsigned) (anchor_ns / 1000000000ULL), (long long unsigned) (anchor_ns % 1000000000ULL));
+
+   if (with_flight_recorder) {
+      fr_init(fr_pre_s, fr_post_s);
+      signal(SIGUSR1, sig_handler);
+      printf("#Flight recorder: history %g s, dump %g s before and %g s after each trigger (SIGUSR1", fr_history_s, fr_pre_s, fr_post_s);
+      if (trigger_event != -1)
+         printf(" or %s > %llu", events[trigger_event].name, (long long unsigned) trigger_threshold);
+      printf(")\n");
+   }
+   printf("#Sampling period: %d us\n", sleep_time);
 
    /* Print list of monitored events */
    for (i = 0; i < nb_events; i++) {
@@ -493,47 +943,106 @@ int main(int argc, char**argv) {
          events[i].exclude_kernel = 1;
       }
 
-      char core_str[3];
+      char core_str[256];
       snprintf(core_str,sizeof(core_str), "%d", events[i].cpu_filter);
-      printf("#Event %d: %s (%llx) (Exclude Kernel: %s, Exclude User: %s, Per node: %s, Configured core(s): %s, use msr = %s)\n", 
+      if (events[i].cpus) {
+         int cpu, len = 0;
+         core_str[0] = '\0';
+         for (cpu = 0; cpu < ncpus && len < (int) sizeof(core_str) - 8; cpu++) {
+            if (numa_bitmask_isbitset(events[i].cpus, cpu))
+               len += snprintf(core_str + len, sizeof(core_str) - len, "%s%d", len ? "," : "", cpu);
+         }
+      }
+
+      char extra[128] = "";
+      if (events[i].config1 || events[i].config2)
+         snprintf(extra, sizeof(extra), ", config1 = %llx, config2 = %llx",
+               (long long unsigned) events[i].config1, (long long unsigned) events[i].config2);
+      if (events[i].unit)
+         snprintf(extra + strlen(extra), sizeof(extra) - strlen(extra), ", scale = %g %s", events[i].scale, events[i].unit);
+
+      printf("#Event %d: %s (%llx) (Exclude Kernel: %s, Exclude User: %s, Per node: %s, Configured core(s): %s, use msr = %s, period = %g ms, type = %s%s)\n", 
             i, 
             events[i].name, 
             (long long unsigned) events[i].config, 
             (events[i].exclude_kernel) ? "yes" : "no", 
             (events[i].exclude_user) ? "yes" : "no", 
             (events[i].per_node) ? "yes" : "no", 
-            events[i].cpu_filter == -1 ? "all" : core_str,
-            events[i].type == PERF_TYPE_RAW && global_use_msr ? "yes" : "no"
+            events[i].cpu_filter == -1 && !events[i].cpus ? "all" : core_str,
+            events[i].raw_code && global_use_msr ? "yes" : "no",
+            (double) events[i].period / TIME_MSECOND,
+            mp_event_type_name(events[i].type),
+            extra
       );
    }
 
-   int nb_threads = nb_observed_pids ? nb_observed_pids : ncpus;
-   if (nb_observed_pids)
-      printf("#Event\tTID\tTime\t\t\tSamples\t%% time enabled\tlogical time\n");
-   else
-      printf("#Event\tCore\tTime\t\t\tSamples\t%% time enabled\tlogical time\n");
+   if(with_numa_report) {
+      numa_report_header();
+   }
+   if(telemetry_sources) {
+      telemetry_init(telemetry_sources);
+      telemetry_header();
+   }
+
+   int nb_threads = ncpus;
+   pdata_t *shards = NULL;
+   if (nb_observed_pids) {
+      if (aggregate_by_comm) {
+         group_tids_by_comm();
+         for (i = 0; i < nb_comm_groups; i++)
+            printf("#Comm group %d: %s\n", i, comm_groups[i]);
+      }
+
+      nb_threads = nb_collectors;
+      if (nb_threads > nb_observed_pids)
+         nb_threads = nb_observed_pids;
+      if (aggregate_by_comm && nb_threads > nb_comm_groups)
+         nb_threads = nb_comm_groups;
+      shards = shard_tids(nb_threads);
+      raise_fd_limit(nb_observed_pids * nb_events + 64);
+      printf("#Collectors: %d\n", nb_threads);
+   }
+
+   printf("#Event\t%s\tTime\t\t\tSamples\t%% time enabled\tlogical time%s%s\n",
+         !nb_observed_pids ? "Core" : aggregate_by_comm ? "Comm group" : "TID",
+         with_ns_timestamps ? "\tTime (ns)" : "",
+         with_multi_rate ? "\tInterval (ns)" : "");
+
+   if (telemetry_sources) {
+      pthread_t telemetry_thread;
+      pthread_create(&telemetry_thread, NULL, telemetry_loop, &sleep_time);
+   }
+
+   /* Spawn 1 spinlooping thread per core if the -ft option is enabled */
+   for (i = 0; with_fake_threads && i < ncpus; i++) {
+      pthread_t spin_thread;
+      pdata_t *data = calloc(1, sizeof(*data));
+      data->core = i;
+      pthread_create(&spin_thread, NULL, spin_loop, data);
+   }
 
    /* 
-    * Spawn 1 monitoring thread on each monitored core
-    * (plus 1 spinlooping thread per core if the -ft option is enabled)
+    * Spawn 1 monitoring thread on each monitored core, or the collectors
+    * of the observed tids
     */   
    pthread_t threads[nb_threads];
    for (i = 0; i < nb_threads; i++) {
-      pdata_t *data = calloc(1, sizeof(*data));
-      if (nb_observed_pids > 0)
-         data->tid = observed_pids[i];
-      else
-         data->core = i;
+      void *(*loop)(void *) = nb_observed_pids ? collector_loop : thread_loop;
+      pdata_t *data;
 
-      if(with_fake_threads) {
-         pthread_create(&threads[i], NULL, spin_loop, data);
+      if (nb_observed_pids) {
+         data = &shards[i];
+      }
+      else {
+         data = calloc(1, sizeof(*data));
+         data->core = i;
       }
 
       if (i != nb_threads - 1) {
-         pthread_create(&threads[i], NULL, thread_loop, data);
+         pthread_create(&threads[i], NULL, loop, data);
       }
       else {
-         thread_loop(data);
+         loop(data);
       }
    }
 
@@ -546,68 +1055,35 @@ int main(int argc, char**argv) {
    return 0;
 }
 
-static long sys_perf_counter_open(struct perf_event_attr *hw_event, pid_t pid, int cpu, int group_fd, unsigned long flags) {
-   int ret = syscall(__NR_perf_counter_open, hw_event, pid, cpu, group_fd, flags);
-#  if defined(__x86_64__) || defined(__i386__)
-   if (ret < 0 && ret > -4096) {
-      errno = -ret;
-      ret = -1;
+static void sig_handler(int signal) {
+   if (signal == SIGUSR1) {
+      fr_trigger(-1, 0, 0);
+      return;
    }
-#  endif
-   return ret;
-}
 
-static void sig_handler(int signal) {
    printf("#signal caught: %d\n", signal);
+   numa_report_summary();
+   telemetry_summary();
    fflush(NULL);
    stop_all_pmu();
    exit(0);
 }
 
-static int hex(char ch) {
-   if ((ch >= '0') && (ch <= '9'))
-      return ch - '0';
-   if ((ch >= 'a') && (ch <= 'f'))
-      return ch - 'a' + 10;
-   if ((ch >= 'A') && (ch <= 'F'))
-      return ch - 'A' + 10;
-   return -1;
-}
-
-static uint64_t hex2u64(const char *ptr) {
-   const char *p = ptr;
-   uint64_t long_val = 0;
-
-   if (p[0] != '0' || (p[1] != 'x' && p[1] != 'X'))
-      die("Wrong format for counter. Expected 0xXXXXXX\n");
-   p += 2;
-
-   while (*p) {
-      const int hex_val = hex(*p);
-      if (hex_val < 0)
-         break;
-
-      long_val = (long_val << 4) | hex_val;
-      p++;
-   }
-   return long_val;
-}
-
 /* 
  * Performs a write access to a given MSR.
  * Assumes that the (x86) msr kernel module is loaded.
  */
 static int wrmsr(int cpu, uint32_t msr, uint64_t val) {
    int fd;
-   char msr_file_name[64];
+   char msr_file_name[256];
 
-   sprintf(msr_file_name, "/dev/cpu/%d/msr", cpu);
+   snprintf(msr_file_name, sizeof(msr_file_name), msr_path, cpu);
 
    fd = open(msr_file_name, O_WRONLY);
    if(fd < 0)
       thread_die("Cannot open msr device on cpu %d\n", cpu);
 
-   if (pwrite(fd, &val, sizeof(val), msr) != sizeof(val)) {
+   if (pwrite(fd, &val, sizeof(val), msr_offset(msr)) != sizeof(val)) {
       if (errno == EIO) {
          thread_die("wrmsr: CPU %d cannot set MSR 0x%08"PRIx32" to 0x%016"PRIx64"\n", cpu, msr, val);
       } else {
@@ -627,15 +1103,15 @@ static int wrmsr(int cpu, uint32_t msr, uint64_t val) {
 static uint64_t rdmsr(int cpu, uint32_t msr) {
    int fd;
    uint64_t data;
-   char msr_file_name[64];
+   char msr_file_name[256];
 
-   sprintf(msr_file_name, "/dev/cpu/%d/msr", cpu);
+   snprintf(msr_file_name, sizeof(msr_file_name), msr_path, cpu);
 
    fd = open(msr_file_name, O_RDONLY);
    if(fd < 0)
       thread_die("Cannot open msr device on cpu %d\n", cpu);
 
-   if (pread(fd, &data, sizeof data, msr) != sizeof data) {
+   if (pread(fd, &data, sizeof data, msr_offset(msr)) != sizeof data) {
       if (errno == EIO) {
          thread_die("rdmsr: CPU %d cannot read MSR 0x%08"PRIx32"\n", cpu, msr);
       } else {
@@ -656,7 +1132,7 @@ void stop_all_pmu() {
 
    for(cpu = 0; cpu < ncpus; cpu++) {
       for(msr = 0; msr < nb_events; msr++) {
-         if(events[msr].type == PERF_TYPE_RAW) {
+         if(events[msr].raw_code) {
             // Stop counting event
             wrmsr(cpu, events[msr].msr_select, 0);
             // Do NOT reset value msr to avoid reading something inconsistent
@@ -41,6 +41,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <linux/perf_event.h>
 #include <sys/ioctl.h>
 #include <sys/time.h>
+#include <sys/stat.h>
 #include <dirent.h>
 #include <numa.h>
 #include <sched.h>
@@ -52,6 +53,17 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #define TIME_MSECOND            1000
 #define PAGE_SIZE               (4*1024)
 
+#define DEFAULT_NB_COLLECTORS   4
+#define DEFAULT_MSR_PATH        "/dev/cpu/%d/msr"
+
+/* --no-idle modes */
+#define IDLE_CONTROL_QOS        0x1
+#define IDLE_CONTROL_CSTATES    0x2
+
+/* --power sources */
+#define TELEMETRY_PERF          0x1
+#define TELEMETRY_MSR           0x2
+
 #undef __NR_perf_counter_open
 #if defined(__x86_64__)
 #define __NR_perf_counter_open  298
@@ -75,14 +87,27 @@ typedef struct _event {
    uint64_t type;
    /* Value describing the chosen event and unitmask (see README). */
    uint64_t config;
+   /* Extra configuration of sysfs PMU events (e.g. offcore response masks) */
+   uint64_t config1;
+   uint64_t config2;
    /* Boolean indicating if kernel-level events must be monitored */
    uint64_t exclude_kernel;
    /* Boolean indicating if user-level events must be monitored */
    uint64_t exclude_user;
 
    const char* name;
+   /* Sampling period of the event (us) */
+   int period;
    char per_node;
    int32_t cpu_filter;
+   /* cpumask of uncore PMUs (NULL = all cpus) */
+   struct bitmask *cpus;
+   /* Scale and unit exported by sysfs PMU events (e.g. RAPL) */
+   double scale;
+   const char *unit;
+
+   /* Raw code given as 0x... (not a sysfs PMU event): can be monitored with --use-msr */
+   char raw_code;
 
    /** Only meaningful for hardware events **/
    /* Id of the MSR control register that will be used to monitor the event */
@@ -108,11 +133,41 @@ struct perf_read_ev {
 #define rdtscll(val) __asm__ __volatile__("rdtsc" : "=A" (val))
 #endif
 
+/* A perf counter, see counter.c */
+struct counter {
+   int fd;
+   /* perf mmap page when the counter can be read with rdpmc, NULL otherwise */
+   struct perf_event_mmap_page *page;
+};
+
+/* mp_counter_open flags */
+#define COUNTER_MMAP            0x1
+#define COUNTER_DISABLED        0x2
+#define COUNTER_GROUP_READ      0x4
+
 typedef struct pdata {
    int core;
-   int tid; /* Tid to observe */
+   /* Per-tid profiling: indexes of the observed tids handled by a collector */
+   int nb_tids;
+   int *tids;
 } pdata_t;
 
+/* Events of a monitoring thread that share the same sampling period */
+struct event_group {
+   int period;             /* us */
+   int nb_events;
+   int *events;            /* indexes in the events array */
+   int logical_time;
+   uint64_t last_tsc;      /* tsc of the previous read of the group */
+   uint64_t next_due;      /* CLOCK_MONOTONIC ns */
+};
+
+struct scheduler {
+   int nb_groups;
+   struct event_group *groups;
+   int *heap;              /* min-heap of group indexes, on next_due */
+};
+
 struct msr {
    int id;
    uint64_t select;
@@ -120,7 +175,56 @@ struct msr {
    int (*can_be_used)(struct msr*, uint64_t);
 };
 
-struct msr* get_msr(uint64_t evt, uint64_t cpu_filter);
-void reserve_msr(int msr_id, uint64_t evt, int cpu_filter);
+void cpuid(unsigned info, unsigned *eax, unsigned *ebx, unsigned *ecx, unsigned *edx);
+unsigned int get_processor_family(void);
+void force_processor_family(unsigned int family);
+void msr_detect_layout(const char *path_format);
+off_t msr_offset(uint32_t msr);
+int can_be_used_10h(struct msr *msr, uint64_t evt);
+int can_be_used_15h(struct msr *msr, uint64_t evt);
+void assign_msrs(event_t *events, int nb_events);
+
+long mp_sys_perf_counter_open(struct perf_event_attr *hw_event, pid_t pid, int cpu, int group_fd, unsigned long flags);
+int mp_counter_open(struct counter *c, event_t *evt, int tid, int core, int group_fd, int flags);
+int mp_counter_read(struct counter *c, struct perf_read_ev *v);
+int mp_counter_read_group(int leader_fd, int nb_counters, struct perf_read_ev *v);
+void mp_counter_close(struct counter *c);
+
+int mp_resolve_event(const char *name, event_t *evt);
+const char *mp_event_type_name(uint64_t type);
+void mp_print_event_symbols(const char *prefix);
+
+void tsc_calibrate(void);
+uint64_t tsc_frequency(void);
+const char *tsc_calibration_source(void);
+void tsc_anchor(uint64_t *tsc, uint64_t *realtime_ns);
+uint64_t tsc_delta_to_ns(uint64_t delta);
+uint64_t tsc_to_ns(uint64_t tsc);
+
+void dump_sample(int evt, int id, uint64_t rdtsc, uint64_t value, double percent_running, int logical_time, uint64_t interval);
+
+struct scheduler *scheduler_create(event_t *events, int nb_events, char *active);
+struct event_group *scheduler_next(struct scheduler *s);
+
+struct flight_recorder;
+void fr_init(double pre_s, double post_s);
+struct flight_recorder *fr_create(size_t nb_samples);
+void fr_trigger(int evt, int id, uint64_t value);
+void fr_record(struct flight_recorder *fr, int evt, int id, uint64_t rdtsc, uint64_t value, double percent_running, int logical_time, uint64_t interval);
+void fr_check(struct flight_recorder *fr, uint64_t now);
+
+int numa_report_add_events(event_t **events, int nb_events);
+void numa_report_header(void);
+void numa_report_sample(int evt, int core, uint64_t value, double percent_running, uint64_t interval, int logical_time);
+void numa_report_summary(void);
+
+void telemetry_init(int sources);
+void telemetry_header(void);
+void *telemetry_loop(void *period);
+void telemetry_summary(void);
+
+void idle_control_enable(int mode);
+void idle_control_restore(void);
+const char *idle_control_description(void);
 
 #endif /* PROFILER_H_ */
@@ -0,0 +1,246 @@
+/*
+Copyright (C) 2012
+Fabien Gaud <fgaud@sfu.ca>, Baptiste Lepers <baptiste.lepers@inria.fr>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "miniprof.h"
+
+/*
+ * NUMA traffic report (--numa-report, AMD 10h and 15h).
+ *
+ * Adds the following per-node events (BKDG 10h/15h, NB events):
+ *  - 1E0h "CPU to DRAM Requests to Target Node", one event per target node
+ *    (unit mask bit = target node). Counted on the source node, so that the
+ *    counts of node src give row src of the traffic matrix. Each request is
+ *    a 64B cache line.
+ *  - F6h-F9h "HyperTransport Link 0-3 Transmit Bandwidth", unit mask 03h
+ *    (command and data dwords).
+ *
+ * The monitoring thread of each node publishes its row once it has read all
+ * the events of an interval. The last node to publish an interval prints
+ * the matrix of that interval. Totals are kept for the summary printed at
+ * exit.
+ */
+#define NUMA_MAX_NODES     8     /* width of the unit mask of 1E0h */
+#define NUMA_NB_LINKS      4
+#define NUMA_HISTORY       8     /* intervals in flight between the nodes */
+#define DRAM_REQUEST_SIZE  64
+#define HT_DWORD_SIZE      4
+
+struct numa_row {
+   int logical_time;
+   int nb_samples;
+   uint64_t interval_ns;
+   double dram[NUMA_MAX_NODES];     /* requests to each target node */
+   double links[NUMA_NB_LINKS];     /* dwords sent on each link */
+};
+
+extern int nnodes;
+
+static int first_event = -1;
+static int nb_report_events;
+static struct numa_row current[NUMA_MAX_NODES];
+static struct numa_row published[NUMA_HISTORY][NUMA_MAX_NODES];
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Totals since the beginning of the run */
+static double total_dram[NUMA_MAX_NODES][NUMA_MAX_NODES];
+static double total_links[NUMA_MAX_NODES][NUMA_NB_LINKS];
+static uint64_t total_ns;
+static int nb_intervals;
+
+static void add_event(event_t *evt, const char *name, uint64_t config) {
+   memset(evt, 0, sizeof(*evt));
+   evt->name = strdup(name);
+   evt->type = PERF_TYPE_RAW;
+   evt->raw_code = 1;
+   evt->config = config;
+   evt->per_node = 1;
+   evt->cpu_filter = -1;
+   evt->scale = 1.;
+}
+
+/* Appends the events of the report to the events array, returns their number */
+int numa_report_add_events(event_t **events, int nb_events) {
+   unsigned int family = get_processor_family();
+   char name[64];
+   int node, link;
+
+   if (family != 0x100f00 && family != 0x600f00)
+      die("--numa-report only supports AMD 10h and 15h processors");
+   if (nnodes > NUMA_MAX_NODES)
+      die("--numa-report supports up to %d nodes (found %d)", NUMA_MAX_NODES, nnodes);
+
+   first_event = nb_events;
+   nb_report_events = nnodes + NUMA_NB_LINKS;
+   *events = realloc(*events, (nb_events + nb_report_events) * sizeof(**events));
+
+   for (node = 0; node < nnodes; node++) {
+      snprintf(name, sizeof(name), "NUMA_DRAM_TO_NODE_%d", node);
+      add_event(&(*events)[first_event + node], name, 0x1000000E0ULL | ((1ULL << node) << 8));
+   }
+   for (link = 0; link < NUMA_NB_LINKS; link++) {
+      snprintf(name, sizeof(name), "NUMA_HT_LINK_%d", link);
+      add_event(&(*events)[first_event + nnodes + link], name, (0xF6 + link) | (0x03 << 8));
+   }
+   return nb_report_events;
+}
+
+void numa_report_header(void) {
+   int node, link;
+
+   printf("#NUMA report: DRAM traffic in MB/s from node (rows) to node (columns), locality = local / total, HT transmit bandwidth in MB/s\n");
+   printf("#NUMA\tinterval\tnode");
+   for (node = 0; node < nnodes; node++)
+      printf("\tto %d", node);
+   printf("\tlocality");
+   for (link = 0; link < NUMA_NB_LINKS; link++)
+      printf("\tHT%d", link);
+   printf("\n");
+}
+
+static double mbps(double bytes, uint64_t ns) {
+   return ns ? bytes * 1e3 / ns : 0;
+}
+
+static double locality(double *dram, int node) {
+   double total = 0;
+   int dst;
+
+   for (dst = 0; dst < nnodes; dst++)
+      total += dram[dst];
+   return total ? dram[node] / total : 1.;
+}
+
+/* Called with the lock held, once all the nodes have published the interval */
+static void print_interval(struct numa_row *rows) {
+   double all_dram[NUMA_MAX_NODES] = { 0 }, all_links[NUMA_NB_LINKS] = { 0 };
+   double local = 0, total = 0;
+   uint64_t ns = 0;
+   int node, dst, link;
+
+   for (node = 0; node < nnodes; node++) {
+      struct numa_row *row = &rows[node];
+
+      printf("#NUMA\t%d\t%d", row->logical_time, node);
+      for (dst = 0; dst < nnodes; dst++) {
+         printf("\t%.1f", mbps(row->dram[dst] * DRAM_REQUEST_SIZE, row->interval_ns));
+         all_dram[dst] += row->dram[dst];
+         total += row->dram[dst];
+         total_dram[node][dst] += row->dram[dst];
+      }
+      local += row->dram[node];
+      printf("\t%.3f", locality(row->dram, node));
+      for (link = 0; link < NUMA_NB_LINKS; link++) {
+         printf("\t%.1f", mbps(row->links[link] * HT_DWORD_SIZE, row->interval_ns));
+         all_links[link] += row->links[link];
+         total_links[node][link] += row->links[link];
+      }
+      printf("\n");
+
+      if (row->interval_ns > ns)
+         ns = row->interval_ns;
+   }
+
+   printf("#NUMA\t%d\tall", rows[0].logical_time);
+   for (dst = 0; dst < nnodes; dst++)
+      printf("\t%.1f", mbps(all_dram[dst] * DRAM_REQUEST_SIZE, ns));
+   printf("\t%.3f", total ? local / total : 1.);
+   for (link = 0; link < NUMA_NB_LINKS; link++)
+      printf("\t%.1f", mbps(all_links[link] * HT_DWORD_SIZE, ns));
+   printf("\n");
+
+   total_ns += ns;
+   nb_intervals++;
+}
+
+static void publish(int node, struct numa_row *row) {
+   struct numa_row *rows = published[row->logical_time % NUMA_HISTORY];
+   int n;
+
+   pthread_mutex_lock(&lock);
+   rows[node] = *row;
+   for (n = 0; n < nnodes; n++) {
+      if (rows[n].logical_time != row->logical_time)
+         break;
+   }
+   if (n == nnodes)
+      print_interval(rows);
+   pthread_mutex_unlock(&lock);
+}
+
+/*
+ * Called by the monitoring threads for every sample. Counts are scaled by
+ * the time the counter was running, since the report needs more NB
+ * counters than available and relies on multiplexing.
+ */
+void numa_report_sample(int evt, int core, uint64_t value, double percent_running, uint64_t interval, int logical_time) {
+   struct numa_row *row;
+   double count = value;
+   int node, idx = evt - first_event;
+
+   if (first_event < 0 || idx < 0 || idx >= nb_report_events)
+      return;
+
+   node = numa_node_of_cpu(core);
+   row = &current[node];
+   if (row->logical_time != logical_time) {
+      memset(row, 0, sizeof(*row));
+      row->logical_time = logical_time;
+   }
+
+   if (percent_running > 0 && percent_running < 1)
+      count /= percent_running;
+   if (idx < nnodes)
+      row->dram[idx] = count;
+   else
+      row->links[idx - nnodes] = count;
+   row->interval_ns = tsc_delta_to_ns(interval);
+
+   if (++row->nb_samples == nb_report_events)
+      publish(node, row);
+}
+
+/* Called at exit (from the signal handler) */
+void numa_report_summary(void) {
+   double local = 0, total = 0;
+   int node, dst, link;
+
+   if (first_event < 0 || !nb_intervals)
+      return;
+
+   printf("#NUMA summary: %d intervals, %.3f s\n", nb_intervals, total_ns / 1e9);
+   printf("#NUMA summary\tnode");
+   for (dst = 0; dst < nnodes; dst++)
+      printf("\tto %d (MB)", dst);
+   printf("\tlocality");
+   for (link = 0; link < NUMA_NB_LINKS; link++)
+      printf("\tHT%d (MB/s)", link);
+   printf("\n");
+
+   for (node = 0; node < nnodes; node++) {
+      printf("#NUMA summary\t%d", node);
+      for (dst = 0; dst < nnodes; dst++) {
+         printf("\t%.1f", total_dram[node][dst] * DRAM_REQUEST_SIZE / 1e6);
+         total += total_dram[node][dst];
+      }
+      local += total_dram[node][node];
+      printf("\t%.3f", locality(total_dram[node], node));
+      for (link = 0; link < NUMA_NB_LINKS; link++)
+         printf("\t%.1f", mbps(total_links[node][link] * HT_DWORD_SIZE, total_ns));
+      printf("\n");
+   }
+   printf("#NUMA summary\tall locality: %.3f\n", total ? local / total : 1.);
+}
@@ -0,0 +1,126 @@
+/*
+Copyright (C) 2012
+Fabien Gaud <fgaud@sfu.ca>, Baptiste Lepers <baptiste.lepers@inria.fr>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "miniprof.h"
+
+/*
+ * Multi-rate scheduler of a monitoring thread.
+ *
+ * The events monitored by a thread are grouped by sampling period. The
+ * groups are kept in a min-heap ordered by the time at which they are due,
+ * and the thread sleeps until the first group is due, reads it, and puts it
+ * back in the heap one period later. Deadlines are absolute, so the periods
+ * do not drift with the time spent reading the counters.
+ */
+#define NSEC_PER_USEC 1000ULL
+
+static uint64_t monotonic_ns(void) {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int due_before(struct scheduler *s, int a, int b) {
+   return s->groups[s->heap[a]].next_due < s->groups[s->heap[b]].next_due;
+}
+
+static void swap(struct scheduler *s, int a, int b) {
+   int tmp = s->heap[a];
+   s->heap[a] = s->heap[b];
+   s->heap[b] = tmp;
+}
+
+static void sift_down(struct scheduler *s, int i) {
+   for (;;) {
+      int smallest = i, left = 2 * i + 1, right = 2 * i + 2;
+
+      if (left < s->nb_groups && due_before(s, left, smallest))
+         smallest = left;
+      if (right < s->nb_groups && due_before(s, right, smallest))
+         smallest = right;
+      if (smallest == i)
+         return;
+      swap(s, i, smallest);
+      i = smallest;
+   }
+}
+
+/*
+ * Creates the groups of the events for which active[i] is set.
+ * All the groups are due immediately.
+ */
+struct scheduler *scheduler_create(event_t *events, int nb_events, char *active) {
+   struct scheduler *s = calloc(1, sizeof(*s));
+   uint64_t now = monotonic_ns(), tsc;
+   int i, g;
+
+   assert(s);
+   rdtscll(tsc);
+
+   for (i = 0; i < nb_events; i++) {
+      if (!active[i])
+         continue;
+
+      for (g = 0; g < s->nb_groups && s->groups[g].period != events[i].period; g++);
+      if (g == s->nb_groups) {
+         s->groups = realloc(s->groups, (s->nb_groups + 1) * sizeof(*s->groups));
+         memset(&s->groups[g], 0, sizeof(*s->groups));
+         s->groups[g].period = events[i].period;
+         s->groups[g].next_due = now;
+         s->groups[g].last_tsc = tsc;
+         s->nb_groups++;
+      }
+
+      s->groups[g].events = realloc(s->groups[g].events, (s->groups[g].nb_events + 1) * sizeof(int));
+      s->groups[g].events[s->groups[g].nb_events++] = i;
+   }
+
+   s->heap = malloc(s->nb_groups * sizeof(*s->heap));
+   for (g = 0; g < s->nb_groups; g++)
+      s->heap[g] = g;
+   return s;
+}
+
+/*
+ * Sleeps until the next group is due and returns it. The group is
+ * rescheduled one period later (periods that were entirely missed are
+ * skipped) and its logical time is incremented.
+ */
+struct event_group *scheduler_next(struct scheduler *s) {
+   struct event_group *g;
+   struct timespec ts;
+   uint64_t now;
+
+   if (!s->nb_groups) {
+      pause();
+      return NULL;
+   }
+
+   g = &s->groups[s->heap[0]];
+   ts.tv_sec = g->next_due / 1000000000ULL;
+   ts.tv_nsec = g->next_due % 1000000000ULL;
+   while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+
+   now = monotonic_ns();
+   g->next_due += g->period * NSEC_PER_USEC;
+   if (g->next_due <= now)
+      g->next_due += ((now - g->next_due) / (g->period * NSEC_PER_USEC) + 1) * g->period * NSEC_PER_USEC;
+   sift_down(s, 0);
+
+   g->logical_time++;
+   return g;
+}
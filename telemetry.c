@@ -0,0 +1,468 @@
+/*
+Copyright (C) 2012
+Fabien Gaud <fgaud@sfu.ca>, Baptiste Lepers <baptiste.lepers@inria.fr>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "miniprof.h"
+
+/*
+ * Frequency and energy telemetry (--power).
+ *
+ * Effective frequency: APERF counts at the actual frequency and MPERF at
+ * the TSC frequency, both only while the core is in C0. Over an interval,
+ * the average frequency while running is tsc_hz * dAPERF / dMPERF and the
+ * fraction of time spent in C0 is dMPERF / dTSC. Read from the aperf and
+ * mperf events of the msr PMU, or from MSRs E8h and E7h.
+ *
+ * Energy: RAPL domains, read from the power (and power_core) PMUs or from
+ * the energy status MSRs (Intel 611h/639h/619h, AMD C001029Bh/C001029Ah).
+ * The energy MSRs are 32-bit wide counters, deltas are computed modulo 2^32,
+ * so the sampling period must be shorter than the time needed to wrap
+ * (several minutes at full power). The perf counters are already extended
+ * to 64 bits by the kernel.
+ *
+ * MSRs are read through msr_path (--msr-path), so that the MSR source can
+ * be tested with regular files in place of /dev/cpu/N/msr (see
+ * msr_offset for their layout).
+ *
+ * Everything is read by one thread, once per sampling period.
+ */
+#define SYSFS_PMUS         "/sys/bus/event_source/devices"
+#define SYSFS_CPUS         "/sys/devices/system/cpu"
+
+#define MSR_MPERF                   0xE7
+#define MSR_APERF                   0xE8
+#define MSR_RAPL_POWER_UNIT         0x606
+#define MSR_PKG_ENERGY_STATUS       0x611
+#define MSR_DRAM_ENERGY_STATUS      0x619
+#define MSR_PP0_ENERGY_STATUS       0x639
+#define MSR_AMD_RAPL_POWER_UNIT     0xC0010299
+#define MSR_AMD_CORE_ENERGY_STATUS  0xC001029A
+#define MSR_AMD_PKG_ENERGY_STATUS   0xC001029B
+
+#define ENERGY_STATUS_MASK          0xffffffffULL
+
+struct freq_core {
+   int cpu;
+   struct counter aperf, mperf;     /* perf source */
+   uint64_t last_aperf, last_mperf;
+};
+
+struct energy_domain {
+   char name[32];
+   int cpu;                         /* cpu on which the domain is read */
+   int id;                          /* package or core id */
+   struct counter counter;          /* perf source */
+   uint32_t msr;                    /* msr source */
+   double joules;                   /* per count */
+   uint64_t last;
+   double total_joules;
+};
+
+extern int ncpus;
+extern const char *msr_path;
+
+static const char *freq_source, *energy_source;
+static int nb_freq_cores;
+static struct freq_core *freq_cores;
+static int nb_domains;
+static struct energy_domain *domains;
+static int *msr_fds;
+static uint64_t total_ns;
+
+/* Reads an MSR without exiting on errors. Returns 0, or -1 */
+static int msr_read(int cpu, uint32_t msr, uint64_t *value) {
+   if (msr_fds[cpu] < 0) {
+      char path[256];
+
+      snprintf(path, sizeof(path), msr_path, cpu);
+      msr_fds[cpu] = open(path, O_RDONLY);
+      if (msr_fds[cpu] < 0)
+         return -1;
+   }
+   return (pread(msr_fds[cpu], value, sizeof(*value), msr_offset(msr)) == sizeof(*value)) ? 0 : -1;
+}
+
+static int read_sysfs_int(const char *fmt, int cpu) {
+   char path[256];
+   FILE *f;
+   int value = -1;
+
+   snprintf(path, sizeof(path), fmt, cpu);
+   f = fopen(path, "r");
+   if (!f)
+      return -1;
+   if (fscanf(f, "%d", &value) != 1)
+      value = -1;
+   fclose(f);
+   return value;
+}
+
+static int package_of_cpu(int cpu) {
+   int package = read_sysfs_int(SYSFS_CPUS "/cpu%d/topology/physical_package_id", cpu);
+   return package < 0 ? 0 : package;
+}
+
+static struct energy_domain *add_domain(const char *name, int cpu, int id) {
+   struct energy_domain *d;
+
+   domains = realloc(domains, (nb_domains + 1) * sizeof(*domains));
+   d = &domains[nb_domains++];
+   memset(d, 0, sizeof(*d));
+   snprintf(d->name, sizeof(d->name), "%s", name);
+   d->cpu = cpu;
+   d->id = id;
+   d->counter.fd = -1;
+   return d;
+}
+
+static uint64_t read_counter(struct counter *c) {
+   struct perf_read_ev v;
+
+   if (mp_counter_read(c, &v))
+      return 0;
+   return v.value;
+}
+
+/*** Frequency ***/
+
+static int freq_open_perf(void) {
+   event_t aperf, mperf;
+   int cpu;
+
+   if (access(SYSFS_PMUS "/msr/events/aperf", F_OK) || access(SYSFS_PMUS "/msr/events/mperf", F_OK))
+      return 0;
+   if (mp_resolve_event("msr/aperf/", &aperf) <= 0 || mp_resolve_event("msr/mperf/", &mperf) <= 0)
+      return 0;
+
+   freq_cores = calloc(ncpus, sizeof(*freq_cores));
+   for (cpu = 0; cpu < ncpus; cpu++)
+      freq_cores[cpu].aperf.fd = freq_cores[cpu].mperf.fd = -1;
+   for (cpu = 0; cpu < ncpus; cpu++) {
+      struct freq_core *f = &freq_cores[cpu];
+
+      f->cpu = cpu;
+      if (mp_counter_open(&f->aperf, &aperf, -1, cpu, -1, 0) < 0 || mp_counter_open(&f->mperf, &mperf, -1, cpu, -1, 0) < 0) {
+         fprintf(stderr, "#WARNING: cannot open msr/aperf/ and msr/mperf/ on cpu %d (%s)\n", cpu, strerror(errno));
+         while (cpu >= 0) {
+            mp_counter_close(&freq_cores[cpu].aperf);
+            mp_counter_close(&freq_cores[cpu].mperf);
+            cpu--;
+         }
+         free(freq_cores);
+         freq_cores = NULL;
+         return 0;
+      }
+   }
+   nb_freq_cores = ncpus;
+   freq_source = "msr PMU (aperf/mperf)";
+   return 1;
+}
+
+static int freq_open_msr(void) {
+   uint64_t value;
+   int cpu;
+
+   freq_cores = calloc(ncpus, sizeof(*freq_cores));
+   for (cpu = 0; cpu < ncpus; cpu++) {
+      freq_cores[cpu].cpu = cpu;
+      freq_cores[cpu].aperf.fd = freq_cores[cpu].mperf.fd = -1;
+      if (msr_read(cpu, MSR_APERF, &value) || msr_read(cpu, MSR_MPERF, &value)) {
+         free(freq_cores);
+         freq_cores = NULL;
+         return 0;
+      }
+   }
+   nb_freq_cores = ncpus;
+   freq_source = "MSRs (APERF/MPERF)";
+   return 1;
+}
+
+static void freq_read(struct freq_core *f, uint64_t *aperf, uint64_t *mperf) {
+   if (f->aperf.fd >= 0) {
+      *aperf = read_counter(&f->aperf);
+      *mperf = read_counter(&f->mperf);
+   }
+   else if (msr_read(f->cpu, MSR_APERF, aperf) || msr_read(f->cpu, MSR_MPERF, mperf)) {
+      *aperf = f->last_aperf;
+      *mperf = f->last_mperf;
+   }
+}
+
+/*** Energy ***/
+
+/* Opens the events of a RAPL PMU (power: package scope, power_core: core scope) */
+static void energy_open_pmu(const char *pmu) {
+   char path[1024], spec[1024];
+   struct dirent *entry;
+   DIR *dir;
+
+   snprintf(path, sizeof(path), SYSFS_PMUS "/%s/events", pmu);
+   dir = opendir(path);
+   if (!dir)
+      return;
+
+   while ((entry = readdir(dir))) {
+      const char *name = entry->d_name;
+      event_t evt;
+      int cpu;
+
+      if (name[0] == '.' || strchr(name, '.'))
+         continue;
+      snprintf(spec, sizeof(spec), "%s/%s/", pmu, name);
+      memset(&evt, 0, sizeof(evt));
+      if (mp_resolve_event(spec, &evt) <= 0)
+         continue;
+      if (!strncmp(name, "energy-", 7))
+         name += 7;
+
+      for (cpu = 0; cpu < ncpus; cpu++) {
+         struct energy_domain *d;
+
+         if (evt.cpus ? !numa_bitmask_isbitset(evt.cpus, cpu) : cpu != 0)
+            continue;
+         d = add_domain(name, cpu, strcmp(pmu, "power") ? cpu : package_of_cpu(cpu));
+         d->joules = evt.scale;
+         if (mp_counter_open(&d->counter, &evt, -1, cpu, -1, 0) < 0) {
+            fprintf(stderr, "#WARNING: cannot open %s on cpu %d (%s)\n", spec, cpu, strerror(errno));
+            nb_domains--;
+            continue;
+         }
+         d->last = read_counter(&d->counter);
+      }
+   }
+   closedir(dir);
+}
+
+static int energy_open_perf(void) {
+   energy_open_pmu("power");
+   energy_open_pmu("power_core");
+   if (!nb_domains)
+      return 0;
+   energy_source = "power PMU";
+   return 1;
+}
+
+static void energy_add_msr(const char *name, int cpu, int id, uint32_t msr, double joules) {
+   struct energy_domain *d;
+   uint64_t value;
+
+   if (msr_read(cpu, msr, &value))
+      return;
+   d = add_domain(name, cpu, id);
+   d->msr = msr;
+   d->joules = joules;
+   d->last = value & ENERGY_STATUS_MASK;
+}
+
+/*
+ * Intel server parts count DRAM energy in a fixed unit of 2^-16 J instead
+ * of the unit of the power unit MSR, see the unit quirks of the intel_rapl
+ * and perf rapl drivers of the kernel.
+ */
+static int has_fixed_dram_unit(void) {
+   static const unsigned int models[] = {
+      0x3F,             /* Haswell-EP */
+      0x4F, 0x56,       /* Broadwell-EP, Broadwell-DE */
+      0x55,             /* Skylake-SP, Cascade Lake, Cooper Lake */
+      0x57, 0x85,       /* Xeon Phi Knights Landing, Knights Mill */
+      0x6A, 0x6C,       /* Ice Lake-SP, Ice Lake-D */
+      0x8F, 0xCF,       /* Sapphire Rapids, Emerald Rapids */
+      0xAD,             /* Granite Rapids */
+   };
+   unsigned int a, b, c, d, model;
+   size_t i;
+
+   cpuid(0x1, &a, &b, &c, &d);
+   if (((a >> 8) & 0xf) != 6)
+      return 0;
+   model = ((a >> 4) & 0xf) | ((a >> 12) & 0xf0);
+   for (i = 0; i < sizeof(models) / sizeof(*models); i++) {
+      if (models[i] == model)
+         return 1;
+   }
+   return 0;
+}
+
+/*
+ * Energy status MSRs, read on the first cpu of each package (and on each
+ * core for the per-core counter of AMD). The energy unit is 1/2^ESU J,
+ * ESU being bits 12:8 of the power unit MSR (except for DRAM on servers).
+ */
+static int energy_open_msr(void) {
+   char vendor[12];
+   int is_amd, cpu, last_package = -1;
+   unsigned int a;
+   uint64_t units;
+   double joules, dram_joules;
+
+   cpuid(0x0, &a, (unsigned int *) vendor, (unsigned int *) (vendor + 8), (unsigned int *) (vendor + 4));
+   is_amd = !memcmp(vendor, "AuthenticAMD", sizeof(vendor));
+
+   if (msr_read(0, is_amd ? MSR_AMD_RAPL_POWER_UNIT : MSR_RAPL_POWER_UNIT, &units))
+      return 0;
+   joules = 1. / (1ULL << ((units >> 8) & 0x1f));
+   dram_joules = (!is_amd && has_fixed_dram_unit()) ? 1. / (1 << 16) : joules;
+
+   for (cpu = 0; cpu < ncpus; cpu++) {
+      int package = package_of_cpu(cpu);
+
+      if (is_amd) {
+         int core = read_sysfs_int(SYSFS_CPUS "/cpu%d/topology/core_id", cpu);
+         int first_sibling = read_sysfs_int(SYSFS_CPUS "/cpu%d/topology/thread_siblings_list", cpu);
+
+         /* One counter per physical core: skip the other hyperthreads */
+         if (first_sibling < 0 || first_sibling == cpu)
+            energy_add_msr("core", cpu, core < 0 ? cpu : core, MSR_AMD_CORE_ENERGY_STATUS, joules);
+      }
+      if (package == last_package)
+         continue;
+      last_package = package;
+
+      if (is_amd) {
+         energy_add_msr("pkg", cpu, package, MSR_AMD_PKG_ENERGY_STATUS, joules);
+      }
+      else {
+         energy_add_msr("pkg", cpu, package, MSR_PKG_ENERGY_STATUS, joules);
+         energy_add_msr("cores", cpu, package, MSR_PP0_ENERGY_STATUS, joules);
+         energy_add_msr("dram", cpu, package, MSR_DRAM_ENERGY_STATUS, dram_joules);
+      }
+   }
+   if (!nb_domains)
+      return 0;
+   energy_source = "RAPL MSRs";
+   return 1;
+}
+
+/* Returns the number of counts since the previous read */
+static uint64_t energy_read(struct energy_domain *d) {
+   uint64_t value, delta;
+
+   if (d->counter.fd >= 0) {
+      value = read_counter(&d->counter);
+      delta = value - d->last;
+   }
+   else {
+      if (msr_read(d->cpu, d->msr, &value))
+         return 0;
+      value &= ENERGY_STATUS_MASK;
+      delta = (value - d->last) & ENERGY_STATUS_MASK;
+   }
+   d->last = value;
+   return delta;
+}
+
+/*** Reporting ***/
+
+/*
+ * sources: TELEMETRY_PERF and/or TELEMETRY_MSR, perf being preferred when
+ * both are allowed. Dies when a source was explicitly requested and cannot
+ * be used for anything.
+ */
+void telemetry_init(int sources) {
+   msr_fds = malloc(ncpus * sizeof(*msr_fds));
+   memset(msr_fds, -1, ncpus * sizeof(*msr_fds));
+
+   if (!(sources & TELEMETRY_PERF) || !freq_open_perf()) {
+      if (sources & TELEMETRY_MSR)
+         freq_open_msr();
+   }
+   if (!(sources & TELEMETRY_PERF) || !energy_open_perf()) {
+      if (sources & TELEMETRY_MSR)
+         energy_open_msr();
+   }
+
+   if (!freq_source && !energy_source)
+      die("--power: no frequency or energy counters available (%s)",
+            sources == TELEMETRY_MSR ? "cannot read the MSRs, is the msr module loaded?" :
+            sources == TELEMETRY_PERF ? "no msr/aperf/ or power PMU events" : "no msr/aperf/, power PMU or MSRs");
+}
+
+void telemetry_header(void) {
+   printf("#Telemetry: frequency from %s, energy from %s\n",
+         freq_source ? freq_source : "nowhere (unavailable)",
+         energy_source ? energy_source : "nowhere (unavailable)");
+   if (freq_source)
+      printf("#Frequency\tinterval\tcore\tGHz\tC0\n");
+   if (energy_source)
+      printf("#Energy\tinterval\tdomain\tid\tJ\tW\n");
+}
+
+void *telemetry_loop(void *arg) {
+   event_t tick = { .period = *(int *) arg };
+   char active = 1;
+   struct scheduler *s = scheduler_create(&tick, 1, &active);
+   struct event_group *g;
+   uint64_t tsc_hz = tsc_frequency();
+   int i;
+
+   while ((g = scheduler_next(s))) {
+      uint64_t rdtsc, interval, ns;
+
+      rdtscll(rdtsc);
+      interval = rdtsc - g->last_tsc;
+      g->last_tsc = rdtsc;
+      ns = tsc_delta_to_ns(interval);
+
+      /* The first tick is due at once: it only takes the baselines */
+      if (g->logical_time == 1) {
+         for (i = 0; i < nb_freq_cores; i++)
+            freq_read(&freq_cores[i], &freq_cores[i].last_aperf, &freq_cores[i].last_mperf);
+         for (i = 0; i < nb_domains; i++)
+            energy_read(&domains[i]);
+         continue;
+      }
+
+      for (i = 0; i < nb_freq_cores; i++) {
+         struct freq_core *f = &freq_cores[i];
+         uint64_t aperf, mperf, da, dm;
+
+         freq_read(f, &aperf, &mperf);
+         da = aperf - f->last_aperf;
+         dm = mperf - f->last_mperf;
+         f->last_aperf = aperf;
+         f->last_mperf = mperf;
+
+         printf("#Frequency\t%d\t%d\t%.3f\t%.3f\n", g->logical_time, f->cpu,
+               dm ? (double) tsc_hz * da / dm / 1e9 : 0.,
+               interval ? (double) dm / interval : 0.);
+      }
+
+      for (i = 0; i < nb_domains; i++) {
+         struct energy_domain *d = &domains[i];
+         double joules = energy_read(d) * d->joules;
+
+         d->total_joules += joules;
+         printf("#Energy\t%d\t%s\t%d\t%.6f\t%.3f\n", g->logical_time, d->name, d->id,
+               joules, ns ? joules * 1e9 / ns : 0.);
+      }
+      total_ns += ns;
+   }
+   return NULL;
+}
+
+/* Called at exit (from the signal handler) */
+void telemetry_summary(void) {
+   int i;
+
+   if (!nb_domains || !total_ns)
+      return;
+
+   printf("#Energy summary: %.3f s\n", total_ns / 1e9);
+   printf("#Energy summary\tdomain\tid\tJ\tW\n");
+   for (i = 0; i < nb_domains; i++)
+      printf("#Energy summary\t%s\t%d\t%.3f\t%.3f\n", domains[i].name, domains[i].id,
+            domains[i].total_joules, domains[i].total_joules * 1e9 / total_ns);
+}
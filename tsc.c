@@ -0,0 +1,176 @@
+/*
+Copyright (C) 2012
+Fabien Gaud <fgaud@sfu.ca>, Baptiste Lepers <baptiste.lepers@inria.fr>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "miniprof.h"
+
+/*
+ * TSC calibration.
+ *
+ * A TSC delta is converted to nanoseconds with ns = (delta * mult) >> shift,
+ * exactly like the kernel does for the perf mmap page. The absolute time of
+ * a sample is then anchor_ns + tsc_to_ns(tsc - anchor_tsc), where
+ * (anchor_tsc, anchor_ns) is a TSC value read at the same time as
+ * CLOCK_REALTIME.
+ */
+#define NSEC_PER_SEC             1000000000ULL
+#define CALIBRATION_TIME_NS      (100 * 1000000ULL)
+#define ANCHOR_TRIES             16
+
+static uint64_t tsc_hz;
+static uint64_t tsc_mult;
+static uint16_t tsc_shift;
+static uint64_t anchor_tsc;
+static uint64_t anchor_ns;
+static const char *calibration_source = "none";
+
+static uint64_t timespec_ns(struct timespec *ts) {
+   return (uint64_t) ts->tv_sec * NSEC_PER_SEC + ts->tv_nsec;
+}
+
+/*
+ * Reads the given clock and a TSC value taken at the same time. The TSC is
+ * read before and after the clock; the pair with the smallest bracket out of
+ * ANCHOR_TRIES is kept to limit the impact of interrupts.
+ */
+static void read_clock_and_tsc(clockid_t clock, uint64_t *tsc, uint64_t *ns) {
+   int i;
+   uint64_t best = UINT64_MAX;
+
+   for (i = 0; i < ANCHOR_TRIES; i++) {
+      struct timespec ts;
+      uint64_t before, after;
+
+      rdtscll(before);
+      clock_gettime(clock, &ts);
+      rdtscll(after);
+
+      if (after - before < best) {
+         best = after - before;
+         *tsc = before + (after - before) / 2;
+         *ns = timespec_ns(&ts);
+      }
+   }
+}
+
+/*
+ * Uses the time_mult/time_shift fields that the kernel exports in the mmap
+ * page of any perf event. These are the values used by the kernel itself to
+ * convert the TSC to nanoseconds, so they do not depend on frequency scaling.
+ */
+static int calibrate_from_perf(void) {
+   struct perf_event_attr attr;
+   struct perf_event_mmap_page *pc;
+   uint32_t seq, mult, shift;
+   int cap_user_time, fd;
+
+   memset(&attr, 0, sizeof(attr));
+   attr.size = sizeof(attr);
+   attr.type = PERF_TYPE_SOFTWARE;
+   attr.config = PERF_COUNT_SW_DUMMY;
+   attr.exclude_kernel = 1;
+
+   fd = syscall(__NR_perf_counter_open, &attr, 0, -1, -1, 0);
+   if (fd < 0)
+      return 0;
+
+   pc = mmap(NULL, PAGE_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+   if (pc == MAP_FAILED) {
+      close(fd);
+      return 0;
+   }
+
+   do {
+      seq = pc->lock;
+      __sync_synchronize();
+      cap_user_time = pc->cap_user_time;
+      mult = pc->time_mult;
+      shift = pc->time_shift;
+      __sync_synchronize();
+   } while (pc->lock != seq);
+
+   munmap(pc, PAGE_SIZE);
+   close(fd);
+
+   if (!cap_user_time || !mult)
+      return 0;
+
+   tsc_mult = mult;
+   tsc_shift = shift;
+   tsc_hz = (uint64_t) (((unsigned __int128) NSEC_PER_SEC << shift) / mult);
+   calibration_source = "perf mmap page";
+   return 1;
+}
+
+/*
+ * Fallback: measures the TSC frequency against CLOCK_MONOTONIC_RAW, which is
+ * not subject to NTP slewing.
+ */
+static void calibrate_from_clock(void) {
+   struct timespec wait = { 0, CALIBRATION_TIME_NS };
+   uint64_t tsc0, tsc1, ns0, ns1;
+
+   read_clock_and_tsc(CLOCK_MONOTONIC_RAW, &tsc0, &ns0);
+   nanosleep(&wait, NULL);
+   read_clock_and_tsc(CLOCK_MONOTONIC_RAW, &tsc1, &ns1);
+
+   if (tsc1 <= tsc0 || ns1 <= ns0)
+      die("Cannot calibrate the TSC (non monotonic clock)");
+
+   tsc_hz = (uint64_t) ((unsigned __int128) (tsc1 - tsc0) * NSEC_PER_SEC / (ns1 - ns0));
+
+   /* Largest shift that keeps mult on 32 bits (no overflow in tsc_to_ns) */
+   for (tsc_shift = 32; tsc_shift > 0; tsc_shift--) {
+      tsc_mult = (uint64_t) (((unsigned __int128) NSEC_PER_SEC << tsc_shift) / tsc_hz);
+      if (tsc_mult <= UINT32_MAX)
+         break;
+   }
+   calibration_source = "CLOCK_MONOTONIC_RAW";
+}
+
+void tsc_calibrate(void) {
+   if (!calibrate_from_perf())
+      calibrate_from_clock();
+
+   read_clock_and_tsc(CLOCK_REALTIME, &anchor_tsc, &anchor_ns);
+}
+
+uint64_t tsc_frequency(void) {
+   return tsc_hz;
+}
+
+const char *tsc_calibration_source(void) {
+   return calibration_source;
+}
+
+void tsc_anchor(uint64_t *tsc, uint64_t *realtime_ns) {
+   *tsc = anchor_tsc;
+   *realtime_ns = anchor_ns;
+}
+
+/* Converts a TSC delta to nanoseconds without overflowing 64 bits */
+uint64_t tsc_delta_to_ns(uint64_t delta) {
+   uint64_t quot = delta >> tsc_shift;
+   uint64_t rem = delta & ((1ULL << tsc_shift) - 1);
+   return quot * tsc_mult + ((rem * tsc_mult) >> tsc_shift);
+}
+
+/* Converts an absolute TSC value to nanoseconds since the epoch (CLOCK_REALTIME) */
+uint64_t tsc_to_ns(uint64_t tsc) {
+   if (tsc >= anchor_tsc)
+      return anchor_ns + tsc_delta_to_ns(tsc - anchor_tsc);
+   return anchor_ns - tsc_delta_to_ns(anchor_tsc - tsc);
+}